@@ -7,6 +7,7 @@ It makes use of the python Sympy library.
 """
 
 import os
+import re
 import sys
 import sympy
 import sympy.printing
@@ -104,6 +105,10 @@ for i in range(nf):
     lin += sympy.simplify(0.25 * S * sympy.diff(v, y[i], 2))
     lin -= sympy.simplify(0.125 * S * sympy.diff(v, y[i])**2)
 
+# Expansion of the linear term in monomials of y, when it is a polynomial
+lin_poly = []
+if sympy.expand(lin).is_polynomial(*y):
+    lin_poly = sympy.Poly(sympy.expand(lin), *y).terms()
 
 # Adjoint divergence of h
 stardivh = 0
@@ -136,7 +141,7 @@ output = open(sys.argv[1], 'w')
 def print_double(symbol, fun_name):
 
     # Generate strings for function declaration
-    dec = "double {}(vector<double> x, vector<double> y)".format(fun_name)
+    dec = "double {}(const double* x, const double* y)".format(fun_name)
     ccode = sympy.ccode(symbol, assign_to="result")
 
     # Write to output file
@@ -144,48 +149,116 @@ def print_double(symbol, fun_name):
     output.write("    return result; \n}\n\n")
 
 
-print_double(stardivh, "stardiv_h_n")
-print_double(v, "potential_n")
-print_double(lin, "linearTerm_n")
-print_double(rho, "zrho_n")
+# Index of component k of point i, for points stored by coordinates
+def batch_index(match):
+    k = int(match.group(1))
+    return "y[i]" if k == 0 else "y[n + i]" if k == 1 else "y[{}*n + i]".format(k)
+
+
+# Print the batched version of a function, evaluated at n points
+def print_batch(symbol, fun_name):
+
+    dec = "void {}_batch(const double* x, const double* y, size_t n, double* out)".format(fun_name)
+    ccode = sympy.ccode(symbol, assign_to="result")
+    ccode = re.sub(r"\by(\d+)\b", batch_index, ccode)
+
+    output.write(dec + "{\n")
+    output.write("    for (size_t i = 0; i < n; ++i) {\n")
+    output.write("        double " + ccode + "\n")
+    output.write("        out[i] = result;\n    }\n}\n\n")
+
+
+def print_function(symbol, fun_name):
+    print_double(symbol, fun_name)
+    print_batch(symbol, fun_name)
+
+
+print_function(stardivh, "stardiv_h_n")
+print_function(v, "potential_n")
+print_function(lin, "linearTerm_n")
+print_function(rho, "zrho_n")
 
 for i in range(ns):
-    print_double(g[i], "phi{}".format(i))
-    print_double(f[i], "a{}".format(i))
+    print_function(g[i], "phi{}".format(i))
+    print_function(f[i], "a{}".format(i))
     for j in range(ns):
-        print_double(gx[i][j], "dxphi{}{}".format(i, j))
-        print_double(fx[i][j], "dxa{}{}".format(i, j))
+        print_function(gx[i][j], "dxphi{}{}".format(i, j))
+        print_function(fx[i][j], "dxa{}{}".format(i, j))
     for j in range(nf):
-        print_double(fy[i][j], "dya{}{}".format(i, j))
+        print_function(fy[i][j], "dya{}{}".format(i, j))
 
 for i in range(nf):
-    print_double(vy[i], "dyv{}".format(i))
-    print_double(h[i], "h{}".format(i))
+    print_function(vy[i], "dyv{}".format(i))
+    print_function(h[i], "h{}".format(i))
+    for j in range(nf):
+        print_function(vyy[i][j], "dyyv{}{}".format(i, j))
 
 for i in range(2*nf):
-    print_double(drif[i], "drif{}".format(i))
-    print_double(diff[i], "diff{}".format(i))
+    print_function(drif[i], "drif{}".format(i))
+    print_function(diff[i], "diff{}".format(i))
+
+for i in range(len(lin_poly)):
+    print_double(lin_poly[i][1], "lin_poly_coeff{}".format(i))
 
 
-def print_matrix(fun_base, n=0, m=0):
+# Print a kernel evaluating several functions at once, with their common
+# subexpressions computed only once, and its batched version.
+def print_fused(symbols, fun_name):
+
+    symbols = [sympy.sympify(e) for e in symbols]
+    replacements, reduced = sympy.cse(symbols, symbols=sympy.numbered_symbols("c"))
+
+    body = ["double {} = {};".format(c, sympy.ccode(e)) for (c, e) in replacements]
+
+    dec = "void {}(const double* x, const double* y, double* out)".format(fun_name)
+    output.write(dec + "{\n")
+    for line in body:
+        output.write("    " + line + "\n")
+    for (m, e) in enumerate(reduced):
+        output.write("    out[{}] = {};\n".format(m, sympy.ccode(e)))
+    output.write("}\n\n")
+
+    dec = "void {}_batch(const double* x, const double* y, size_t n, double* out)".format(fun_name)
+    output.write(dec + "{\n")
+    output.write("    for (size_t i = 0; i < n; ++i) {\n")
+    for line in body:
+        output.write("        " + re.sub(r"\by(\d+)\b", batch_index, line) + "\n")
+    for (m, e) in enumerate(reduced):
+        index = "i" if m == 0 else "n + i" if m == 1 else "{}*n + i".format(m)
+        output.write("        out[{}] = {};\n".format(index, re.sub(r"\by(\d+)\b", batch_index, sympy.ccode(e))))
+    output.write("    }\n}\n\n")
+
+
+# Vector field of the extended fast process
+print_fused(drif + diff, "fast_field_n")
+
+# Functions entering the coefficients of the effective equation
+layout = [("a", ns), ("dxa", ns*ns), ("stardiv_h", 1), ("phi", ns),
+          ("dxphi", ns*ns), ("dya", ns*nf), ("zrho", 1)]
+
+print_fused(f + sum(fx, []) + [stardivh] + g + sum(gx, []) + sum(fy, []) + [rho],
+            "coefficients_n")
+
+
+def print_matrix(fun_base, n=0, m=0, suffix=""):
     if (n == 0):
-        s = fun_base
+        s = fun_base + suffix
     else:
         s = "{"
         for i in range(n):
-            s += print_matrix(fun_base + "{}".format(i), m, 0)
+            s += print_matrix(fun_base + "{}".format(i), m, 0, suffix)
             s += ", " if i != n - 1 else "}"
     return s
 
 
-def allocate_function_pointer(fun_base, n=0, m=0):
+def allocate_function_pointer(fun_base, n=0, m=0, suffix=""):
     if(n == 0):
         # Case of scalar output
-        output.write("    {} = {}_n;\n".format(fun_base, fun_base))
+        output.write("    {}{} = {}_n{};\n".format(fun_base, suffix, fun_base, suffix))
 
     elif(n > 0):
-        s = print_matrix(fun_base, n, m)
-        output.write("    {} = {};\n".format(fun_base, s))
+        s = print_matrix(fun_base, n, m, suffix)
+        output.write("    {}{} = {};\n".format(fun_base, suffix, s))
 
 output.write("void Problem::init_functions() {\n\n")
 
@@ -201,6 +274,7 @@ allocate_function_pointer("zrho")
 allocate_function_pointer("linearTerm")
 allocate_function_pointer("potential")
 allocate_function_pointer("dyv", nf)
+allocate_function_pointer("dyyv", nf, nf)
 allocate_function_pointer("h", nf)
 allocate_function_pointer("a", ns)
 allocate_function_pointer("dxa", ns, ns)
@@ -209,6 +283,45 @@ allocate_function_pointer("phi", ns)
 allocate_function_pointer("dxphi", ns, ns)
 allocate_function_pointer("drif", 2*nf)
 allocate_function_pointer("diff", 2*nf)
+
+# Allocation of batched function pointers
+output.write("\n")
+for (fun_base, n, m) in [("stardiv_h", 0, 0), ("zrho", 0, 0), ("linearTerm", 0, 0),
+                         ("potential", 0, 0), ("dyv", nf, 0), ("dyyv", nf, nf),
+                         ("h", nf, 0), ("a", ns, 0), ("dxa", ns, ns), ("dya", ns, nf),
+                         ("phi", ns, 0), ("dxphi", ns, ns), ("drif", 2*nf, 0),
+                         ("diff", 2*nf, 0)]:
+    allocate_function_pointer(fun_base, n, m, "_batch")
+
+# Dependency of the functions on the slow variable
+def depends_on_x(symbols):
+    if isinstance(symbols, (list, tuple)):
+        return any(depends_on_x(e) for e in symbols)
+    return sympy.sympify(symbols).has(*x)
+
+dependencies = [("stardiv_h", stardivh), ("zrho", rho), ("linearTerm", lin),
+                ("potential", v), ("dyv", vy), ("dyyv", vyy), ("h", h), ("a", f),
+                ("dxa", fx), ("dya", fy), ("phi", g), ("dxphi", gx), ("drif", drif),
+                ("diff", diff), ("lin_poly_coeffs", [c for (m, c) in lin_poly])]
+
+dependencies = ", ".join("{{\"{}\", {}}}".format(name, "true" if depends_on_x(e) else "false")
+                         for (name, e) in dependencies)
+output.write("    x_dependent = {{{}}};\n\n".format(dependencies))
+
+# Fused kernels, and positions of the functions in the output of coefficients
+output.write("\n")
+allocate_function_pointer("fast_field")
+allocate_function_pointer("coefficients")
+allocate_function_pointer("coefficients", suffix="_batch")
+
+offsets = [sum(size for (name, size) in layout[:i]) for i in range(len(layout) + 1)]
+output.write("    coefficients_layout = {{{}}};\n\n".format(", ".join(str(o) for o in offsets)))
+
+# Polynomial expansion of the linear term
+exponents = ", ".join("{" + ", ".join(str(e) for e in m) + "}" for (m, c) in lin_poly)
+coeffs = ", ".join("lin_poly_coeff{}".format(i) for i in range(len(lin_poly)))
+output.write("    lin_poly_exponents = {{{}}};\n".format(exponents))
+output.write("    lin_poly_coeffs = {{{}}};\n".format(coeffs))
 output.write("}")
 
 # Latex output file
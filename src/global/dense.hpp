@@ -0,0 +1,37 @@
+#ifndef DENSE_H
+#define DENSE_H
+
+#include <vector>
+#include <armadillo>
+
+/*! Dense matrix with contiguous column-major storage
+ *
+ * This is the layout of Armadillo, so the matrix can be passed to it without
+ * copy. A set of n points in dimension d, stored as an n x d matrix, has each
+ * of its coordinates contiguous, which is the layout expected by the batched
+ * functions of Problem; stored as a d x n matrix, it has each point contiguous.
+ */
+class dense_mat {
+    public:
+
+        size_t n_rows, n_cols;
+        std::vector<double> mem;
+
+        dense_mat(size_t n_rows = 0, size_t n_cols = 0, double value = 0.) :
+            n_rows(n_rows), n_cols(n_cols), mem(n_rows*n_cols, value) {}
+
+        double& operator() (size_t i, size_t j) { return mem[i + j*n_rows]; }
+        double operator() (size_t i, size_t j) const { return mem[i + j*n_rows]; }
+
+        double* memptr() { return mem.data(); }
+        const double* memptr() const { return mem.data(); }
+        double* colptr(size_t j) { return mem.data() + j*n_rows; }
+        const double* colptr(size_t j) const { return mem.data() + j*n_rows; }
+
+        // Armadillo matrix aliasing the memory of the matrix, without copy.
+        // Writing to it writes to the matrix.
+        arma::mat arma() { return arma::mat(mem.data(), n_rows, n_cols, false, true); }
+        const arma::mat arma() const { return arma::mat(const_cast<double*>(mem.data()), n_rows, n_cols, false, true); }
+};
+
+#endif
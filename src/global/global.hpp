@@ -8,6 +8,8 @@
 #include<vector>
 #include<armadillo>
 
+#include "global/dense.hpp"
+
 // Definition of types
 namespace std {
     typedef std::vector< std::vector< std::vector<double> > > cube;
@@ -39,6 +39,15 @@ template<class type> std::vector<type> operator*(const std::vector<type>& vec, c
     return result;
 }
 
+// In-place scaling, which doesn't allocate. It applies recursively to nested
+// vectors, so that it also works on std::mat.
+template<class type> std::vector<type>& operator*=(std::vector<type>& vec, const double& x) {
+    for (unsigned int i = 0; i < vec.size(); ++i) {
+        vec[i] *= x;
+    }
+    return vec;
+}
+
 std::mat operator*(const std::mat& mat1, const std::mat& mat2);
 std::vec operator*(const std::mat& mat, const std::vec& vec);
 double operator*(const std::vec& vec1, const std::vec& vec2);
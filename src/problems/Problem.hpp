@@ -5,6 +5,8 @@
 
 #include <math.h>
 #include <vector>
+#include <map>
+#include <string>
 #include <iostream>
 
 #include "global/global.hpp"
@@ -41,18 +43,61 @@ class Problem {
         void init_functions();
 
 
-        double (*potential) (std::vec x, std::vec y);
-        double (*linearTerm) (std::vec x, std::vec y);
-        double (*zrho) (std::vec x, std::vec y);
-        double (*stardiv_h) (std::vec x, std::vec y);
-        std::vector<double (*) (std::vec x, std::vec y)> dyv;
-        std::vector<double (*) (std::vec x, std::vec y)> h;
-        std::vector<double (*) (std::vec x, std::vec y)> a;
-        std::vector< std::vector<double (*) (std::vec x, std::vec y)> > dxa;
-        std::vector< std::vector<double (*) (std::vec x, std::vec y)> > dya;
-        std::vector<double (*) (std::vec x, std::vec y)> phi;
-        std::vector< std::vector<double (*) (std::vec x, std::vec y)> > dxphi;
-        std::vector<double (*) (std::vec x, std::vec y)> drif;
-        std::vector<double (*) (std::vec x, std::vec y)> diff;
+        double (*potential) (const double* x, const double* y);
+        double (*linearTerm) (const double* x, const double* y);
+        double (*zrho) (const double* x, const double* y);
+        double (*stardiv_h) (const double* x, const double* y);
+        std::vector<double (*) (const double* x, const double* y)> dyv;
+        std::vector< std::vector<double (*) (const double* x, const double* y)> > dyyv;
+        std::vector<double (*) (const double* x, const double* y)> h;
+        std::vector<double (*) (const double* x, const double* y)> a;
+        std::vector< std::vector<double (*) (const double* x, const double* y)> > dxa;
+        std::vector< std::vector<double (*) (const double* x, const double* y)> > dya;
+        std::vector<double (*) (const double* x, const double* y)> phi;
+        std::vector< std::vector<double (*) (const double* x, const double* y)> > dxphi;
+        std::vector<double (*) (const double* x, const double* y)> drif;
+        std::vector<double (*) (const double* x, const double* y)> diff;
+
+        // Batched versions of the functions above, evaluated at n points with
+        // the same x. The points are stored by coordinates: component k of
+        // point i is y[k*n + i]. The values are written to out[0], ..., out[n-1].
+        void (*potential_batch) (const double* x, const double* y, size_t n, double* out);
+        void (*linearTerm_batch) (const double* x, const double* y, size_t n, double* out);
+        void (*zrho_batch) (const double* x, const double* y, size_t n, double* out);
+        void (*stardiv_h_batch) (const double* x, const double* y, size_t n, double* out);
+        std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> dyv_batch;
+        std::vector< std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> > dyyv_batch;
+        std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> h_batch;
+        std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> a_batch;
+        std::vector< std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> > dxa_batch;
+        std::vector< std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> > dya_batch;
+        std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> phi_batch;
+        std::vector< std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> > dxphi_batch;
+        std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> drif_batch;
+        std::vector<void (*) (const double* x, const double* y, size_t n, double* out)> diff_batch;
+
+        // Fused kernels, evaluating groups of the functions above at one point
+        // with their common subexpressions computed only once:
+        //  - fast_field: drif[0], ..., drif[2nf-1], then diff[0], ..., diff[2nf-1];
+        //  - coefficients: a, dxa, stardiv_h, phi, dxphi, dya and zrho, with
+        //    matrices in row-major order, at the positions given by coefficients_layout.
+        // The batched version writes output m at point i to out[m*n + i].
+        void (*fast_field) (const double* x, const double* y, double* out);
+        void (*coefficients) (const double* x, const double* y, double* out);
+        void (*coefficients_batch) (const double* x, const double* y, size_t n, double* out);
+
+        struct layout { int a, dxa, stardiv_h, phi, dxphi, dya, zrho, size; };
+        layout coefficients_layout;
+
+        // Expansion of linearTerm in monomials of y, when it is a polynomial:
+        // linearTerm(x,y) = sum_k lin_poly_coeffs[k](x,y) * y^lin_poly_exponents[k],
+        // where the coefficients depend only on x. Empty otherwise.
+        std::vector< std::vector<int> > lin_poly_exponents;
+        std::vector<double (*) (const double* x, const double* y)> lin_poly_coeffs;
+
+        // Whether the functions above depend on the slow variable x, by name.
+        // Functions that are not listed are assumed to depend on x.
+        std::map<std::string, bool> x_dependent;
+        bool depends_on_x(std::string function);
 };
 #endif
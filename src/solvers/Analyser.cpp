@@ -4,37 +4,29 @@
 #include "global/templates.hpp"
 #include "toolbox/Gaussian_integrator.hpp"
 #include "toolbox/linear_algebra.hpp"
+#include "toolbox/parallel.hpp"
 #include "io/io.hpp"
 #include "global/global.hpp"
 
 using namespace std;
 
-// Consntructor of the analyser. The only parameter is the problem that
-// the analyser will follow.
-Analyser::Analyser(Problem *p) {
+// Consntructor of the analyser. The parameters are the problem that the
+// analyser will follow, and optionally the configuration of the iteration.
+Analyser::Analyser(Problem *p, config_analyser *config) {
 
     // Assign variables derived from problem
     problem = p;
     nf = problem->nf;
 
-    // Initialize other variables to reasonable values
-    normalization = 1.;
-    det_sqrt_cov = 1.;
+    if (config != NULL)
+        conf = *config;
 
-    bias = std::vec(problem->nf, 0.);
-    eig_val_cov = std::vec(problem->nf, 1.);
-
-    covariance = std::mat(nf, std::vec (nf,0.));
-    inv_cov = std::mat(nf, std::vec (nf,0.));
-    sqrt_cov = std::mat(nf, std::vec (nf,0.));
-    eig_vec_cov = std::mat(nf, std::vec (nf,0.));
-
-    for (int i = 0; i < problem->nf; ++i) {
-        covariance[i][i] = 1.;
-        inv_cov[i][i] = 1.;
-        sqrt_cov[i][i] = 1.;
-        eig_vec_cov[i][i] = 1.;
-    }
+    // Standard Gaussian until the first update
+    standard_gaussian(previous);
+    previous.n_nodes = conf.n_nodes;
+    previous.normalization = 1.;
+    previous.n_iterations = 0;
+    assign(previous);
 }
 
 /* Analyser::Analyser(const Analyser& a) { */
@@ -42,94 +34,403 @@ Analyser::Analyser(Problem *p) {
 /*     this->nf = a.nf; */
 /* } */
 
-// Implementation of a rescaling used to approximate the invariant measure.
-std::vec Analyser::rescale(std::vec y) {
-    std::vec result(y.size(), 0.);
-    for (unsigned int i = 0; i < y.size(); ++i) {
-        for (unsigned int j = 0; j < y.size(); ++j) {
-            result[i] += sqrt_cov[i][j] * y[j];
-        }
+// Update statistics of the invariant measure at x, and make them current.
+void Analyser::update_stats(std::vec x) {
+
+    // The invariant measure does not depend on x, and has already been computed.
+    if (!this->x.empty() && !problem->depends_on_x("zrho"))
+        return;
+
+    assign(stats(x));
+}
+
+/*! Statistics of the invariant measure, from the cache if possible
+ *
+ * The key of the cache is the quadrature and the value of x, which is left
+ * out when the invariant measure does not depend on it. A hit moves the
+ * statistics to the front of the list, and a miss adds them there, removing
+ * those at the back when the cache is full.
+ */
+analyser_stats Analyser::stats(const std::vec& x, int n_nodes) {
+
+    if (n_nodes == 0)
+        n_nodes = conf.n_nodes;
+
+    stats_key key(n_nodes, problem->depends_on_x("zrho") ? x : std::vec());
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    auto entry = cache_index.find(key);
+    if (entry != cache_index.end()) {
+        cache.splice(cache.begin(), cache, entry->second);
+        return entry->second->second;
+    }
+
+    analyser_stats result = compute(x, n_nodes);
+    if (conf.cache_size <= 0)
+        return result;
+
+    cache.push_front(make_pair(key, result));
+    cache_index[key] = cache.begin();
+    if ((int) cache.size() > conf.cache_size) {
+        cache_index.erase(cache.back().first);
+        cache.pop_back();
     }
-    return (result + bias);
+
+    return result;
 }
 
-// Update statistics of the invariant measure at x.
-// The outer loop serves to obtain a more accurate result.
-void Analyser::update_stats(std::vec x) {
+/*! Computation of the statistics of the invariant measure at x
+ *
+ * The iteration starts from the Gaussian found at the previous computation,
+ * which is close to the new one when x has moved little (warm start), or
+ * from a fixed Gaussian otherwise (cold start). A warm start that turns out
+ * to be too far from the new Gaussian is replaced by a cold start.
+ */
+analyser_stats Analyser::compute(const std::vec& x, int n_nodes) {
+
+    analyser_stats s = previous;
+    s.x = x;
+    s.n_nodes = n_nodes;
+    s.n_iterations = 0;
+
+    bool warm = conf.warm_start && !previous.x.empty();
+    if (!warm)
+        cold_start(s);
+
+    int max_iterations = conf.max_iterations;
+    if (warm && conf.warm_iterations > 0)
+        max_iterations = min(max_iterations, conf.warm_iterations);
+
+    if (!iterate(s, max_iterations, warm ? conf.restart_tolerance : 0.)) {
+        cold_start(s);
+        iterate(s, conf.max_iterations, 0.);
+    }
+
+    previous = s;
+    return s;
+}
+
+void Analyser::assign(const analyser_stats& s) {
+    x = s.x;
+    bias = s.bias;
+    covariance = s.covariance;
+    eig_val_cov = s.eig_val_cov;
+    eig_vec_cov = s.eig_vec_cov;
+    sqrt_cov = s.sqrt_cov;
+    inv_cov = s.inv_cov;
+    det_sqrt_cov = s.det_sqrt_cov;
+    normalization = s.normalization;
+    n_iterations = s.n_iterations;
+}
+
+void Analyser::standard_gaussian(analyser_stats& s) {
+    s.bias = std::vec(nf, 0.);
+    s.covariance = std::mat(nf, std::vec(nf, 0.));
+    for (int i = 0; i < nf; ++i)
+        s.covariance[i][i] = 1.;
+    update_factors(s);
+}
+
+// Standard Gaussian, or its Laplace approximation if enabled
+void Analyser::cold_start(analyser_stats& s) {
+
+    standard_gaussian(s);
+    if (conf.laplace && !laplace_approximation(s)) {
+        cout << "Warning: no nondegenerate minimum of the potential, starting from the standard Gaussian" << endl;
+        standard_gaussian(s);
+    }
+}
 
-    Gaussian_integrator gauss_plus = Gaussian_integrator(100, nf);
-    Gaussian_integrator gauss = Gaussian_integrator(30, nf);
+/*! Fixed-point iteration on the Gaussian approximation
+ *
+ * The density is evaluated at the nodes of a quadrature adapted to the
+ * current Gaussian approximation, and the normalization, first and second
+ * moments are then accumulated together, in a single pass over the nodes.
+ * This gives a better Gaussian approximation, and the iteration is repeated
+ * until it converges. The moments are taken about the current bias, which
+ * avoids cancellations in the covariance.
+ *
+ * If restart_tolerance > 0 and the first iteration changes the Gaussian by
+ * more than it, relative to the size of the covariance, the Gaussian is left
+ * unchanged and false is returned.
+ */
+bool Analyser::iterate(analyser_stats& s, int max_iterations, double restart_tolerance) {
 
-    int n_iterations = 10, i = 0;
-    for (int n = 0; n < n_iterations; ++n) {
+    const std::vec& x = s.x;
+    shared_ptr<const Gaussian_integrator> gauss = Gaussian_integrator::cached(s.n_nodes, nf, conf.prune);
+
+    // Weights of the quadrature divided by the standard Gaussian at the nodes,
+    // which don't change from one iteration to the next.
+    int n_nodes = gauss->nodes.n_cols;
+    std::vec scaled_weights(n_nodes), density(n_nodes);
+
+    #pragma omp parallel for
+    for (int k = 0; k < n_nodes; ++k)
+        scaled_weights[k] = gauss->weights[k] / gaussian(gauss->nodes.colptr(k), nf);
+
+    // The unknowns of the iteration are the bias and the covariance, in
+    // row-major order. For the Anderson acceleration, history of the
+    // iterates and of their images.
+    int n_unknowns = nf + nf*nf;
+    vector<arma::vec> iterates, images;
+
+    for (int n = 0; n < max_iterations; ++n) {
+
+        s.n_iterations++;
+
+        // Nodes in the original variables, one per row, and unnormalized
+        // density at the nodes, evaluated in one call.
+        dense_mat ys = gauss->map_nodes(s.sqrt_cov, s.bias);
+        evaluate_batch(problem->zrho_batch, x.data(), ys, 1, density.data());
+
+        // Moments of y - bias: order 0, then 1, then 2 in row-major order
+        int n_moments = 1 + nf + nf*nf;
+        std::vec moments(n_moments, 0.);
+        blocked_reduce(n_nodes, n_moments, moments.data(), [&] (size_t first, size_t last, double* partial) {
+            std::vec d(nf);
+            for (size_t k = first; k < last; ++k) {
+                double w = scaled_weights[k] * density[k];
+                for (int i = 0; i < nf; ++i)
+                    d[i] = ys(k,i) - s.bias[i];
+                partial[0] += w;
+                for (int i = 0; i < nf; ++i) {
+                    partial[1 + i] += w * d[i];
+                    for (int j = i; j < nf; ++j)
+                        partial[1 + nf + i*nf + j] += w * d[i] * d[j];
+                }
+            }
+        });
 
         // Normalization constant
-        auto lambda = [&] (std::vec z) -> double {
-            std::vec y = rescale(z);
-            return det_sqrt_cov * problem->zrho(x,y)/gaussian(z);
-        };
-        normalization = gauss_plus.quadnd(lambda);
-
-        // Calculation of the bias of 'rho'
-        bias = std::vec (nf, 0.);
-        for (i = 0; i < nf; ++i) {
-            auto lambda = [&] (std::vec z) -> double {
-                std::vec y = rescale(z);
-                return det_sqrt_cov * y[i] * (rho(x,y)/gaussian(z));
-            };
-            bias[i] = gauss_plus.quadnd(lambda);
-        }
+        s.normalization = s.det_sqrt_cov * moments[0];
 
-        // Calculation of the covariance matrix
-        for (i = 0; i < nf; ++i) {
+        // Current iterate, and its image by the iteration
+        arma::vec iterate(n_unknowns), image(n_unknowns);
+        for (int i = 0; i < nf; ++i) {
+            double mean = moments[1 + i] / moments[0];
+            iterate(i) = s.bias[i];
+            image(i) = s.bias[i] + mean;
             for (int j = 0; j < nf; ++j) {
-                auto lambda = [&] (std::vec z) -> double {
-                    std::vec y = rescale(z);
-                    return det_sqrt_cov * (y[i] - bias[i]) * (y[j] - bias[j]) * (rho(x,y)/gaussian(z));
-                };
-                covariance[i][j] = gauss_plus.quadnd(lambda);
+                int ij = (i <= j) ? i*nf + j : j*nf + i;
+                iterate(nf + i*nf + j) = s.covariance[i][j];
+                image(nf + i*nf + j) = moments[1 + nf + ij] / moments[0] - mean * moments[1 + j] / moments[0];
             }
         }
 
-        // Eigenvalue decomposition
-        arma::vec eigval;
-        arma::mat eigvec;
-        eig_sym(eigval, eigvec, to_arma(covariance));
-        eig_val_cov = to_std_vec(eigval);
-        eig_vec_cov = to_std(eigvec);
-
-        sqrt_cov = eig_vec_cov;
-        for (int i = 0; i < nf; i++) {
-            for (int j = 0; j < nf; j++) {
-                sqrt_cov[i][j] *= sqrt(eig_val_cov[j]);
+        double change = 0., size = 0.;
+        for (int u = 0; u < n_unknowns; ++u)
+            change = max(change, fabs(image(u) - iterate(u)));
+        for (int u = nf; u < n_unknowns; ++u)
+            size = max(size, fabs(image(u)));
+
+        if (n == 0 && restart_tolerance > 0. && change > restart_tolerance * (1. + size))
+            return false;
+
+        // Anderson acceleration: combination of the last images which
+        // minimizes the combination of the residuals, in the least squares sense.
+        arma::vec next = image;
+        if (conf.anderson > 0) {
+            iterates.push_back(iterate);
+            images.push_back(image);
+            if ((int) iterates.size() > conf.anderson + 1) {
+                iterates.erase(iterates.begin());
+                images.erase(images.begin());
             }
-        }
 
-        // Determinant of sqrt_cov
-        for (det_sqrt_cov = 1., i = 0; i < nf; ++i)
-            det_sqrt_cov *= sqrt(eig_val_cov[i]);
+            int m = iterates.size() - 1;
+            if (m > 0) {
+                arma::mat dF(n_unknowns, m), dG(n_unknowns, m);
+                for (int l = 0; l < m; ++l) {
+                    dG.col(l) = images[l+1] - images[l];
+                    dF.col(l) = dG.col(l) - (iterates[l+1] - iterates[l]);
+                }
+                // Normal equations, slightly regularized
+                arma::mat normal = dF.t() * dF;
+                double trace = 0.;
+                for (int l = 0; l < m; ++l)
+                    trace += normal(l,l);
+                for (int l = 0; l < m; ++l)
+                    normal(l,l) += 1e-14 * (1. + trace);
+                arma::vec gamma = arma::solve(normal, dF.t() * (image - iterate));
+                next = image - dG * gamma;
+            }
+        }
 
-        // Inverse of covariance matrix
-        inv_cov = to_std(to_arma(covariance).i());
+        // Update of the Gaussian, without acceleration if it doesn't give a
+        // positive definite covariance.
+        for (int pass = 0; pass < 2; ++pass) {
+            for (int i = 0; i < nf; ++i) {
+                s.bias[i] = next(i);
+                for (int j = 0; j < nf; ++j)
+                    s.covariance[i][j] = next(nf + i*nf + j);
+            }
+            if (update_factors(s))
+                break;
+            if (pass == 1)
+                cout << "Warning: covariance of the invariant measure is not positive definite" << endl;
+            next = image;
+            iterates.clear();
+            images.clear();
+        }
 
         if(DEBUG) {
-            cout << endl << "--- Normalization constant: " << normalization << endl;
+            cout << endl << "--- Normalization constant: " << s.normalization << endl;
 
             cout << endl << "* Covariance matrix of the invariant density" << endl;
-            niceMat(covariance);
+            niceMat(s.covariance);
 
             /* cout << endl << "* Inverse of the covariance matrix" << endl; */
-            /* niceMat(inv_cov); */
+            /* niceMat(s.inv_cov); */
 
             cout << endl << "* Bias of the invariant density" << endl;
-            niceVec(bias);
+            niceVec(s.bias);
 
             /* cout << endl << "* Eigenvectors of the covariance matrix" << endl; */
-            /* niceMat(eig_vec_cov); */
+            /* niceMat(s.eig_vec_cov); */
+        }
+
+        if (change <= conf.tolerance * (1. + size))
+            break;
+    }
+
+    return true;
+}
+
+bool Analyser::update_factors(analyser_stats& s) {
+
+    // Eigenvalue decomposition
+    arma::vec eigval;
+    arma::mat eigvec;
+    eig_sym(eigval, eigvec, to_arma(s.covariance));
+    if (eigval.min() <= 0.)
+        return false;
+
+    s.eig_val_cov = to_std_vec(eigval);
+    s.eig_vec_cov = to_std(eigvec);
+
+    s.sqrt_cov = s.eig_vec_cov;
+    for (int i = 0; i < nf; i++) {
+        for (int j = 0; j < nf; j++) {
+            s.sqrt_cov[i][j] *= sqrt(s.eig_val_cov[j]);
         }
     }
+
+    // Determinant of sqrt_cov
+    s.det_sqrt_cov = 1.;
+    for (int i = 0; i < nf; ++i)
+        s.det_sqrt_cov *= sqrt(s.eig_val_cov[i]);
+
+    // Inverse of covariance matrix
+    s.inv_cov = to_std(to_arma(s.covariance).i());
+
+    return true;
 }
 
-double Analyser::rho(std::vec x, std::vec y) {
-    return problem->zrho(x,y)/normalization;
+/*! Laplace approximation of the invariant measure
+ *
+ * Newton's method is started from the current bias and from the points at
+ * one standard deviation from it along each eigenvector of the covariance,
+ * so that the minima on either side of a barrier are found. Each minimum m,
+ * with Hessian H, contributes a Gaussian of mean m and covariance H^-1, with
+ * weight exp(-potential(m)) / sqrt(det(H)), and the Gaussian approximation
+ * is the one with the mean and covariance of this mixture.
+ */
+bool Analyser::laplace_approximation(analyser_stats& s) {
+
+    const std::vec& x = s.x;
+
+    vector<arma::vec> minima, inverses;
+    vector<double> potentials, dets;
+
+    for (int start = 0; start < 2*nf + 1; ++start) {
+
+        arma::vec y = to_arma_vec(s.bias);
+        if (start > 0)
+            for (int i = 0; i < nf; ++i)
+                y(i) += (start % 2 ? 1. : -1.) * s.sqrt_cov[i][(start - 1)/2];
+
+        arma::mat hessian(nf, nf);
+        if (!newton_minimum(x, y, hessian))
+            continue;
+
+        bool found = false;
+        for (unsigned int m = 0; m < minima.size(); ++m)
+            found = found || arma::norm(y - minima[m]) <= 1e-6 * (1. + arma::norm(minima[m]));
+        if (found)
+            continue;
+
+        minima.push_back(y);
+        inverses.push_back(hessian.i());
+        potentials.push_back(problem->potential(x.data(), y.memptr()));
+        dets.push_back(arma::det(hessian));
+    }
+
+    if (minima.empty())
+        return false;
+
+    // Weights of the minima, relative to the lowest one
+    double lowest = *min_element(potentials.begin(), potentials.end());
+    arma::vec weights(minima.size());
+    for (unsigned int m = 0; m < minima.size(); ++m)
+        weights(m) = exp(lowest - potentials[m]) / sqrt(dets[m]);
+    weights /= arma::accu(weights);
+
+    arma::vec mean(nf, arma::fill::zeros);
+    for (unsigned int m = 0; m < minima.size(); ++m)
+        mean += weights(m) * minima[m];
+
+    arma::mat cov(nf, nf, arma::fill::zeros);
+    for (unsigned int m = 0; m < minima.size(); ++m)
+        cov += weights(m) * (inverses[m] + (minima[m] - mean) * (minima[m] - mean).t());
+
+    s.bias = to_std_vec(mean);
+    s.covariance = to_std(cov);
+    return update_factors(s);
+}
+
+/*! Minimum of the potential by Newton's method
+ *
+ * The Newton step is replaced by a steepest descent step where the Hessian
+ * is not positive definite, and halved until the potential decreases. The
+ * point found is a minimum if the Hessian is positive definite there.
+ */
+bool Analyser::newton_minimum(const std::vec& x, arma::vec& y, arma::mat& hessian) {
+
+    arma::vec gradient(nf), step;
+
+    for (int n = 0; n < 100; ++n) {
+
+        for (int i = 0; i < nf; ++i) {
+            gradient(i) = problem->dyv[i](x.data(), y.memptr());
+            for (int j = 0; j < nf; ++j)
+                hessian(i,j) = problem->dyyv[i][j](x.data(), y.memptr());
+        }
+
+        arma::mat R;
+        step = arma::chol(R, hessian) ? arma::vec(-arma::solve(hessian, gradient)) : arma::vec(-gradient);
+
+        double v = problem->potential(x.data(), y.memptr()), t = 1.;
+        while (t > 1e-12) {
+            arma::vec z = y + t * step;
+            if (problem->potential(x.data(), z.memptr()) <= v)
+                break;
+            t /= 2.;
+        }
+
+        y += t * step;
+        if (t * arma::abs(step).max() <= 1e-12 * (1. + arma::abs(y).max()))
+            break;
+    }
+
+    for (int i = 0; i < nf; ++i)
+        for (int j = 0; j < nf; ++j)
+            hessian(i,j) = problem->dyyv[i][j](x.data(), y.memptr());
+
+    // Degenerate minima, such as that of y^4, are rejected: their Laplace
+    // approximation would have a nearly infinite covariance.
+    arma::vec eigval;
+    arma::mat eigvec;
+    eig_sym(eigval, eigvec, hessian);
+    return y.is_finite() && eigval.min() > 1e-8 * max(1., eigval.max());
 }
@@ -5,10 +5,85 @@
 
 #include <math.h>
 #include <vector>
+#include <list>
+#include <map>
+#include <mutex>
 #include <iostream>
 
 #include "problems/Problem.hpp"
 
+struct config_analyser {
+
+    // Number of nodes per dimension of the quadrature, and relative weight
+    // below which its nodes are dropped, see Gaussian_integrator.
+    int n_nodes = 100;
+    double prune = 0.;
+
+    // The statistics are obtained by a fixed-point iteration, each quadrature
+    // being adapted to the Gaussian found at the previous iteration. It stops
+    // when the bias and the covariance change by less than tolerance,
+    // relative to the size of the covariance, or after max_iterations.
+    int max_iterations = 10;
+    double tolerance = 1e-12;
+
+    // Number of previous iterates used by the Anderson acceleration of the
+    // iteration, 0 to disable it.
+    int anderson = 0;
+
+    // Start each update from the Gaussian of the previous one (warm start),
+    // or from the standard Gaussian (0). A warm start is limited to
+    // warm_iterations, if positive, which is enough when x has moved little
+    // since the previous update. If its first iteration changes the Gaussian
+    // by more than restart_tolerance, relative to the size of the covariance,
+    // it is abandoned for a full re-estimation from the standard Gaussian
+    // (never if restart_tolerance is 0).
+    int warm_start = 1;
+    int warm_iterations = 0;
+    double restart_tolerance = 0.;
+
+    // Start full re-estimations from the Laplace approximation of the density
+    // exp(-potential) instead of the standard Gaussian: the minima of the potential are found by Newton's
+    // method, and the starting Gaussian has the mean and covariance of the
+    // mixture of the Gaussians centered at the minima, with covariance the
+    // inverse of the Hessian there. It is exact for quadratic potentials, and
+    // close for concentrated densities, for which one or two quadratures are
+    // then enough.
+    int laplace = 0;
+
+    // Maximum number of statistics kept in memory, the least recently used
+    // being discarded first, or 0 to disable the cache.
+    int cache_size = 64;
+};
+
+/*! Statistics of the invariant measure at a value of the slow variable
+ *
+ * Gaussian approximation of the measure, with the factors of its covariance
+ * used to map quadrature nodes, and normalization of the density.
+ */
+struct analyser_stats {
+
+    // Value of the slow variable, and number of nodes per dimension of the
+    // quadrature used.
+    std::vector<double> x;
+    int n_nodes;
+
+    std::vector<double> bias;
+    std::vector< std::vector<double> > covariance;
+
+    // Eigenvalue decomposition, square root, inverse and square root of the
+    // determinant of the covariance matrix.
+    std::vector<double> eig_val_cov;
+    std::vector< std::vector<double> > eig_vec_cov;
+    std::vector< std::vector<double> > sqrt_cov;
+    std::vector< std::vector<double> > inv_cov;
+    double det_sqrt_cov;
+
+    double normalization;
+
+    // Number of iterations of the quadrature that gave the statistics
+    int n_iterations;
+};
+
 /*! Class to track the properties of the invariant measure of the fast process
  * Provides function that describe the statistics of this measure.
  */
@@ -16,8 +91,8 @@
 class Analyser {
     public:
 
-        // Constructor
-        Analyser(Problem *problem);
+        // Constructor, with the default configuration if none is given
+        Analyser(Problem *problem, config_analyser *config = NULL);
 
         // Copy constructor;
         /* Analyser(const Analyser& a); */
@@ -49,17 +124,56 @@ class Analyser {
         // Normalization of the density
         double normalization;
 
-        // Normalized density of the problem
-        double rho(std::vector<double> x, std::vector<double> y);
-
         // Update stats of the invariant density
         void update_stats(std::vector<double> x);
 
-        // Rescaling
-        std::vector<double> rescale(std::vector<double> y);
+        // Statistics of the invariant density at x, with n_nodes per dimension
+        // in the quadrature, or those of the configuration if n_nodes is 0.
+        // They are computed once and then taken from a cache, shared by all
+        // the users of the analyser, whose public members are not modified.
+        // Safe to call from several threads.
+        analyser_stats stats(const std::vector<double>& x, int n_nodes = 0);
+
+        // Number of iterations of the last update
+        int n_iterations;
 
     private:
 
+        config_analyser conf;
+
+        // Computation of the statistics at x, starting from those of the
+        // previous computation, see update_stats.
+        analyser_stats compute(const std::vector<double>& x, int n_nodes);
+        analyser_stats previous;
+
+        // Copy of statistics to the public members
+        void assign(const analyser_stats& s);
+
+        // Standard Gaussian, with its factors
+        void standard_gaussian(analyser_stats& s);
+
+        // Iteration from the Gaussian of s, and starting Gaussian of a full
+        // re-estimation, see update_stats
+        bool iterate(analyser_stats& s, int max_iterations, double restart_tolerance);
+        void cold_start(analyser_stats& s);
+
+        // Eigenvalue decomposition, square root, determinant and inverse of
+        // the covariance matrix of s. Returns false if it is not positive definite.
+        bool update_factors(analyser_stats& s);
+
+        // Laplace approximation of the invariant measure at s.x, and minimum
+        // of the potential reached by Newton's method from y, with the
+        // Hessian there. Both return false if they fail.
+        bool laplace_approximation(analyser_stats& s);
+        bool newton_minimum(const std::vector<double>& x, arma::vec& y, arma::mat& hessian);
+
+        // Statistics by quadrature and value of the slow variable, the most
+        // recently used first, with an index into the list.
+        typedef std::pair< int, std::vector<double> > stats_key;
+        std::list< std::pair<stats_key, analyser_stats> > cache;
+        std::map< stats_key, std::list< std::pair<stats_key, analyser_stats> >::iterator > cache_index;
+        std::mutex cache_mutex;
+
         // Problem associated with Analyser
         Problem *problem;
 
@@ -6,6 +6,15 @@
 class Solver {
     public:
         virtual SDE_coeffs estimator(std::vector<double> x, double t) = 0;
+
+        // Estimation at several values of the slow variable. Solvers that can
+        // share work between the points override this method.
+        virtual std::vector<SDE_coeffs> estimator_batch(const std::vector< std::vector<double> >& xs, double t) {
+            std::vector<SDE_coeffs> result(xs.size());
+            for (unsigned int i = 0; i < xs.size(); ++i)
+                result[i] = estimator(xs[i], t);
+            return result;
+        }
 };
 
 #endif
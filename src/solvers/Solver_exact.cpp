@@ -1,69 +1,104 @@
 #include "problems/Problem.hpp"
 #include "toolbox/Gaussian_integrator.hpp"
+#include "toolbox/parallel.hpp"
 #include "solvers/Solver_exact.hpp"
 
 using namespace std;
 
-Solver_exact::Solver_exact(Problem* p, Analyser* a) {
+Solver_exact::Solver_exact(Problem* p, Analyser* a, double prune) {
     problem = p;
     analyser = a;
+    this->prune = prune;
 }
 
 SDE_coeffs Solver_exact::estimator(vec x, double t) {
-    analyser->update_stats(x);
-    SDE_coeffs sde_coeffs;
-    sde_coeffs.drif = soldrif(x);
-    sde_coeffs.diff = soldiff(x);
-    return sde_coeffs;
+    shared_ptr<const Gaussian_integrator> gauss = Gaussian_integrator::cached(100, problem->nf, prune);
+    dense_mat ys;
+    vec ws;
+    discretize_density(*gauss, analyser->stats(x), ys, ws);
+    return estimate(x, ys, ws);
 }
 
-vec Solver_exact::soldrif(vec x) {
+/*! Exact coefficients at several values of the slow variable
+ *
+ * When the invariant measure does not depend on x, the quadrature nodes are
+ * mapped to the original variables and the density is evaluated at them only
+ * once, for all the points.
+ */
+vector<SDE_coeffs> Solver_exact::estimator_batch(const vector<vec>& xs, double t) {
 
-    int ns = problem->ns;
-    int nf = problem->nf;
+    if (xs.empty() || problem->depends_on_x("zrho"))
+        return Solver::estimator_batch(xs, t);
 
-    vec result(ns,0.);
-    Gaussian_integrator gauss = Gaussian_integrator(100,nf);
+    shared_ptr<const Gaussian_integrator> gauss = Gaussian_integrator::cached(100, problem->nf, prune);
+    dense_mat ys;
+    vec ws;
+    discretize_density(*gauss, analyser->stats(xs[0]), ys, ws);
 
-    // Function to integrate to obtain exact drift.
-    auto lambda = [&] (vec z) -> vec {
-        vec y = analyser->rescale(z);
-        vec tmp(ns, 0.);
-        for (int i = 0; i < ns; ++i) {
-            tmp[i] += problem->phi[i](x,y) * problem->stardiv_h(x,y);
-            for (int j = 0; j < ns; ++j) {
-                tmp[i] += problem->dxphi[i][j](x,y) * problem->a[j](x,y);
-            }
-        }
-        return tmp*(analyser->rho(x,y)/gaussian(z));
-    };
+    vector<SDE_coeffs> result(xs.size());
+    for (unsigned int p = 0; p < xs.size(); ++p)
+        result[p] = estimate(xs[p], ys, ws);
 
-    result = gauss.quadnd(lambda, result) * analyser->det_sqrt_cov;
     return result;
 }
 
-mat Solver_exact::soldiff(vec x) {
+// Nodes of the quadrature in the original variables, one per row, and
+// weights of the quadrature multiplied by the invariant density, at the
+// value of x of the statistics.
+void Solver_exact::discretize_density(const Gaussian_integrator& gauss, const analyser_stats& stats, dense_mat& ys, vec& ws) {
+
+    int n_nodes = gauss.nodes.n_cols;
+
+    ys = gauss.map_nodes(stats.sqrt_cov, stats.bias);
+    ws = vec(n_nodes);
+    evaluate_batch(problem->zrho_batch, stats.x.data(), ys, 1, ws.data());
+
+    #pragma omp parallel for
+    for (int k = 0; k < n_nodes; ++k) {
+        ws[k] *= gauss.weights[k] * stats.det_sqrt_cov
+            / (stats.normalization * gaussian(gauss.nodes.colptr(k), gauss.nodes.n_rows));
+    }
+}
+
+// Exact drift and diffusion coefficients, by quadrature
+SDE_coeffs Solver_exact::estimate(vec x, const dense_mat& ys, const vec& ws) {
 
     int ns = problem->ns;
-    int nf = problem->nf;
+    int n_nodes = ws.size();
+
+    // Values of the functions at the nodes, evaluated with the fused kernel,
+    // one function per column.
+    Problem::layout L = problem->coefficients_layout;
+    dense_mat values(n_nodes, L.size);
+    evaluate_batch(problem->coefficients_batch, x.data(), ys, L.size, values.memptr());
 
-    Gaussian_integrator gauss = Gaussian_integrator(100,nf);
-    mat result(ns,vec(ns,0.));
+    const double *a = values.colptr(L.a), *phi = values.colptr(L.phi);
+    const double *dxphi = values.colptr(L.dxphi), *stardiv_h = values.colptr(L.stardiv_h);
 
-    // Function to integrate to obtain exact diffusion coefficient.
-    auto lambda = [&] (vec z) -> mat {
-        vec y = analyser->rescale(z);
-        mat tens_prod(ns, vec(ns, 0.));
+    // Sums over the nodes: drift first, then diffusion in row-major order
+    vec sums(ns + ns*ns, 0.);
+    blocked_reduce(n_nodes, ns + ns*ns, sums.data(), [&] (size_t first, size_t last, double* partial) {
         for (int i = 0; i < ns; ++i) {
+            for (size_t k = first; k < last; ++k) {
+                double tmp = phi[i*n_nodes + k] * stardiv_h[k];
+                for (int j = 0; j < ns; ++j)
+                    tmp += dxphi[(i*ns + j)*n_nodes + k] * a[j*n_nodes + k];
+                partial[i] += tmp * ws[k];
+            }
             for (int j = 0; j < ns; ++j) {
-                tens_prod[i][j] = 2*problem->a[i](x,y)*problem->phi[j](x,y)*(analyser->rho(x,y)/gaussian(z));
+                for (size_t k = first; k < last; ++k)
+                    partial[ns + i*ns + j] += 2 * a[i*n_nodes + k] * phi[j*n_nodes + k] * ws[k];
             }
         }
-        return tens_prod;
-    };
-    /* mat tmp = symmetric( gauss.quadnd(lambda, result) * analyser->det_sqrt_cov ); */
-    /* cout << tmp[0][0] << "," << tmp[0][1] << endl << tmp[1][0] << "," << tmp[1][1]; */
-    /* exit(0); */
-    result = square_root(symmetric( gauss.quadnd(lambda, result) * analyser->det_sqrt_cov ));
-    return result;
+    });
+
+    SDE_coeffs sde_coeffs;
+    sde_coeffs.drif = vec(sums.begin(), sums.begin() + ns);
+    mat diff(ns, vec(ns, 0.));
+    for (int i = 0; i < ns; ++i)
+        for (int j = 0; j < ns; ++j)
+            diff[i][j] = sums[ns + i*ns + j];
+
+    sde_coeffs.diff = square_root(symmetric(diff));
+    return sde_coeffs;
 }
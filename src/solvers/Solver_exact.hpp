@@ -5,17 +5,22 @@
 #include "problems/Problem.hpp"
 #include "solvers/Analyser.hpp"
 #include "solvers/Solver.hpp"
+#include "toolbox/Gaussian_integrator.hpp"
 
 class Solver_exact : public Solver {
 
     public:
-        Solver_exact(Problem *p, Analyser *a);
+        // The quadrature has 100 nodes per dimension, dropping those whose
+        // relative weight is below prune, see Gaussian_integrator.
+        Solver_exact(Problem *p, Analyser *a, double prune = 0.);
         SDE_coeffs estimator(std::vec x, double t);
+        std::vector<SDE_coeffs> estimator_batch(const std::vector<std::vec>& xs, double t);
 
     private:
         Problem *problem;
         Analyser *analyser;
-        std::vec soldrif(std::vec x);
-        std::mat soldiff(std::vec x);
+        double prune;
+        void discretize_density(const Gaussian_integrator& gauss, const analyser_stats& stats, dense_mat& ys, std::vec& ws);
+        SDE_coeffs estimate(std::vec x, const dense_mat& ys, const std::vec& ws);
 };
 #endif
@@ -12,7 +12,33 @@ Solver_hmm::Solver_hmm(Problem *prob, config_hmm *config) {
     problem = prob;
 }
 
+// Random number generator seeded from the current time
+default_random_engine Solver_hmm::seeded_generator() {
+    default_random_engine generator;
+    generator.seed(time(NULL));
+    normal_distribution<double> distribution(0.0,1.0);
+    int seed = (int) abs(1000*distribution(generator));
+    generator.seed(seed);
+    return generator;
+}
+
 SDE_coeffs Solver_hmm::estimator(vec xt, double t) {
+    default_random_engine generator = seeded_generator();
+    return estimate(xt, generator);
+}
+
+// The micro simulations at different points are independent, but they draw
+// from a single random number generator: successive calls to estimator within
+// the same second would otherwise use the same Brownian increments.
+vector<SDE_coeffs> Solver_hmm::estimator_batch(const vector<vec>& xs, double t) {
+    default_random_engine generator = seeded_generator();
+    vector<SDE_coeffs> result(xs.size());
+    for (unsigned int i = 0; i < xs.size(); ++i)
+        result[i] = estimate(xs[i], generator);
+    return result;
+}
+
+SDE_coeffs Solver_hmm::estimate(vec xt, default_random_engine& generator) {
 
     // Vectors to store the coefficients of the sde
     SDE_coeffs sde_coeffs;
@@ -24,40 +50,44 @@ SDE_coeffs Solver_hmm::estimator(vec xt, double t) {
     sde_coeffs.drif = vec(problem->ns, 0.);
     sde_coeffs.diff = mat(problem->ns, vec(problem->ns, 0.));
 
-    default_random_engine generator;
-    generator.seed(time(NULL));
     normal_distribution<double> distribution(0.0,1.0);
-    int seed = (int) abs(1000*distribution(generator));
-    generator.seed(seed);
 
     // Construction of the array that will contain the solution for the
-    // fast process at each macro time-step.
-    mat yAux(conf->nt + conf->n + conf->np, vec(2*problem->nf,0.));
+    // fast process at each macro time-step, one step per column.
+    int n_steps = conf->nt + conf->n + conf->np;
+    dense_mat yAux(2*problem->nf, n_steps);
+
+    // Values of the functions entering the estimators along the path of the
+    // fast process, evaluated with the fused kernel, one step per column.
+    Problem::layout L = problem->coefficients_layout;
+    dense_mat values(L.size, n_steps);
 
     // Loop for ensemble average
     for (int m = 0; m < conf->M; m++) {
 
         // Initialization of the fast variables
-        yAux[0] = yInit;
+        copy(yInit.begin(), yInit.end(), yAux.colptr(0));
 
-        vec drift(2*problem->nf);
-        vec diffu(2*problem->nf);
+        // Drift and diffusion of the extended fast process, one after the other
+        vec field(4*problem->nf);
+        double *drift = field.data(), *diffu = field.data() + 2*problem->nf;
 
         // Euler-Maruyama method for the fast processes:
-        for (unsigned int j = 0; j < yAux.size() - 1; j++) {
+        for (int j = 0; j < n_steps - 1; j++) {
 
-            for (int k = 0; k < 2*problem->nf; ++k) {
-                drift[k] = problem->drif[k](xt, yAux[j]);
-                diffu[k] = problem->diff[k](xt, yAux[j]);
-            }
+            problem->fast_field(xt.data(), yAux.colptr(j), field.data());
 
             for (int k = 0; k < 2*problem->nf; k++)
             {
-                yAux[j+1][k] = yAux[j][k] + drift[k]*conf->micro_dt +
+                yAux(k,j+1) = yAux(k,j) + drift[k]*conf->micro_dt +
                     diffu[k]*sqrt(conf->micro_dt)*distribution(generator);
             }
         }
 
+        for (int j = 0; j < n_steps; j++) {
+            problem->coefficients(xt.data(), yAux.colptr(j), values.colptr(j));
+        }
+
         // Construction of auxiliary vector for efficiency.
 
         // sumsAux1 =approx= dax
@@ -69,9 +99,9 @@ SDE_coeffs Solver_hmm::estimator(vec xt, double t) {
         // First component of each vector
         for (int index = 0; index <= conf->np; index++) {
             for (int k = 0; k < problem->ns; ++k) {
-                sumsAux2[0][k] = sumsAux2[0][k] + problem->a[k](xt, yAux[index]);
+                sumsAux2[0][k] = sumsAux2[0][k] + values(L.a + k, index);
                 for (int l = 0; l < problem->ns; ++l) {
-                    sumsAux1[0][k][l] = sumsAux1[0][k][l] + problem->dxa[k][l](xt, yAux[index]);
+                    sumsAux1[0][k][l] = sumsAux1[0][k][l] + values(L.dxa + k*problem->ns + l, index);
                 }
             }
         }
@@ -79,9 +109,9 @@ SDE_coeffs Solver_hmm::estimator(vec xt, double t) {
         // Recursion to obtain the other components
         for (int index = 1; index < conf->nt + conf->n; index++) {
             for (int k = 0; k < problem->ns; ++k) {
-                sumsAux2[index][k] = sumsAux2[index-1][k] + problem->a[k](xt, yAux[index + conf->np]) - problem->a[k](xt, yAux[index-1]);
+                sumsAux2[index][k] = sumsAux2[index-1][k] + values(L.a + k, index + conf->np) - values(L.a + k, index-1);
                 for (int l = 0; l < problem->ns; ++l) {
-                    sumsAux1[index][k][l] = sumsAux1[index-1][k][l] + problem->dxa[k][l](xt, yAux[index + conf->np]) - problem->dxa[k][l](xt, yAux[index-1]);
+                    sumsAux1[index][k][l] = sumsAux1[index-1][k][l] + values(L.dxa + k*problem->ns + l, index + conf->np) - values(L.dxa + k*problem->ns + l, index-1);
                 }
             }
         }
@@ -97,21 +127,20 @@ SDE_coeffs Solver_hmm::estimator(vec xt, double t) {
             mat dya_j(problem->ns, vec (problem->nf));
             for (int k = 0; k < problem->ns; ++k) {
                 for (int l = 0; l < problem->nf; ++l) {
-                    dya_j[k][l] = problem->dya[k][l](xt, yAux[j]);
+                    dya_j[k][l] = values(L.dya + k*problem->nf + l, j);
                 }
             }
 
             // first term
             for (int i1 = 0; i1 < problem->ns; i1++) {
                 for (int k = 0; k < problem->nf; k++)
-                    fim1[i1] += dya_j[i1][k]*yAux[j][problem->nf+k];
+                    fim1[i1] += dya_j[i1][k]*yAux(problem->nf+k,j);
             }
 
             // second term: improved
             for (int i1 = 0; i1 < problem->ns; i1++) {
                 for (int i2 = 0; i2 < problem->ns; i2++) {
-                    fim2[i1] += conf->micro_dt*problem->a[i2](xt, \
-                            yAux[j])*sumsAux1[j][i1][i2];
+                    fim2[i1] += conf->micro_dt*values(L.a + i2, j)*sumsAux1[j][i1][i2];
                 }
             }
         }
@@ -128,8 +157,7 @@ SDE_coeffs Solver_hmm::estimator(vec xt, double t) {
         for (int i1 = 0; i1 < problem->ns; i1++) {
             for (int i2 = 0; i2 < problem->ns; i2++) {
                 for (int j = conf->nt; j < conf->nt + conf->n; j++) {
-                    him[i1][i2] += conf->micro_dt*problem->a[i1](xt, \
-                            yAux[j])*sumsAux2[j][i2];
+                    him[i1][i2] += conf->micro_dt*values(L.a + i1, j)*sumsAux2[j][i2];
                 }
                 him[i1][i2] = 2*him[i1][i2]/conf->n;
             }
@@ -148,7 +176,7 @@ SDE_coeffs Solver_hmm::estimator(vec xt, double t) {
     sde_coeffs.diff = square_root(symmetric(sde_coeffs.diff));
 
     // Initial condition for next iteration and storage of y
-    yInit = yAux[yAux.size()-1];
+    yInit = vec(yAux.colptr(n_steps-1), yAux.colptr(n_steps-1) + 2*problem->nf);
 
     // return coefficients of the SDE
     return sde_coeffs;
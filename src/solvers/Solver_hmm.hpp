@@ -32,10 +32,15 @@ class Solver_hmm : public Solver {
     public:
         Solver_hmm(Problem*, config_hmm*);
         SDE_coeffs estimator(std::vector<double> x, double t);
+        std::vector<SDE_coeffs> estimator_batch(const std::vector< std::vector<double> >& xs, double t);
         static config_hmm sensible_conf(int p, int M);
 
     private:
         Problem *problem;
         config_hmm *conf;
+
+        // Estimation at x with the given random number generator
+        SDE_coeffs estimate(std::vector<double> x, std::default_random_engine& generator);
+        std::default_random_engine seeded_generator();
 };
 #endif
@@ -1,10 +1,13 @@
 /* TODO: Problem with exact sigma (urbain, Wed 20 May 2015 21:00:20 BST) */
 
 #include "toolbox/linear_algebra.hpp"
+#include "toolbox/parallel.hpp"
 #include "solvers/Solver_spectral.hpp"
 #include "global/templates.hpp"
 #include "io/io.hpp"
 #include <iomanip>
+#include <map>
+#include <algorithm>
 
 using namespace std;
 
@@ -16,130 +19,500 @@ SDE_coeffs Solver_spectral::estimator(vec x, double t) {
 
 vector<SDE_coeffs> Solver_spectral::full_estimator(vec x, double t, vector<int> degrees) {
 
-    // Update statistics
-    analyser->update_stats(x);
-
     // Parameters of the problem
     int nf = problem->nf;
     int ns = problem->ns;
+    int n_functions = ns + ns*ns + 1;
+
+    // Statistics of the Gaussian and factorization of the linear system
+    this->update_factorization(x);
+
+    // Discretization of functions in hermite components, one per column
+    arma::mat functions_discretized_herm = project_herm(discretize_functions(x));
+
+    // Solution of the Poisson equation
+    vector<SDE_coeffs> result(degrees.size());
+    arma::mat sub_sol;
+
+    for (unsigned int i = 0; i < degrees.size(); ++i) {
+
+        int d = degrees[i];
+
+        // Dimension of the space of polynomials of degree lower or equal to i.
+        int n = bin(d + nf, nf);
+
+        // Right-hand sides, and solutions obtained by using polynomials of degree up to i.
+        arma::mat sub_rhs = functions_discretized_herm.rows(0, n-1);
+
+        // Start from the solution of lower degree, when available
+        arma::mat guess = arma::zeros<arma::mat>(n, n_functions);
+        if (!sub_sol.is_empty() && (int) sub_sol.n_rows <= n)
+            guess.rows(0, sub_sol.n_rows - 1) = sub_sol;
+
+        sub_sol = solve(sub_rhs, guess);
+        result[i] = compute_averages(sub_rhs, sub_sol);
+    }
+    return result;
+}
+
+/*! Estimation of the coefficients at several values of the slow variable
+ *
+ * When the matrix of the linear system does not depend on x, the functions
+ * are discretized at several points, projected on the Hermite basis with a
+ * single matrix product, and the linear systems are solved for all the
+ * right-hand sides at once. The points are processed by chunks, so that the
+ * discretized functions of a chunk take at most max_entries doubles.
+ */
+vector<SDE_coeffs> Solver_spectral::estimator_batch(const vector<vec>& xs, double t) {
+
+    if (xs.empty() || problem->depends_on_x("zrho") || problem->depends_on_x("linearTerm"))
+        return Solver::estimator_batch(xs, t);
+
+    int ns = problem->ns;
+    int n_functions = ns + ns*ns + 1;
+    int n_points = xs.size();
+
+    this->update_factorization(xs[0]);
+
+    const size_t max_entries = 1 << 24;
+    size_t ni = gauss->weights.size();
+    int chunk = max((size_t) 1, max_entries / (ni * n_functions));
+
+    vector<SDE_coeffs> result(n_points);
+    for (int first = 0; first < n_points; first += chunk) {
+
+        int size = min(chunk, n_points - first);
+
+        // Discretization of the functions at the points of the chunk, side by side
+        arma::mat functions_discretized_space(ni, n_functions*size);
+        for (int k = 0; k < size; ++k)
+            functions_discretized_space.cols(k*n_functions, (k+1)*n_functions - 1) = discretize_functions(xs[first + k]);
+
+        arma::mat rhs = project_herm(functions_discretized_space);
+        arma::mat sol = solve(rhs, arma::zeros<arma::mat>(rhs.n_rows, rhs.n_cols));
+
+        for (int k = 0; k < size; ++k) {
+            result[first + k] = compute_averages(rhs.cols(k*n_functions, (k+1)*n_functions - 1),
+                                                 sol.cols(k*n_functions, (k+1)*n_functions - 1));
+        }
+    }
+    return result;
+}
+
+// Update the statistics of the Gaussian and the factorization of the linear
+// system at x. These depend on x only through the invariant measure and the
+// linear term; when these do not depend on x, they are computed only once.
+void Solver_spectral::update_factorization(vec x) {
+
+    bool reuse = factorization_x.size() > 0
+        && !problem->depends_on_x("zrho") && !problem->depends_on_x("linearTerm");
+
+    if (reuse)
+        return;
 
     // Update statistics of Gaussian
-    this->update_stats();
+    this->update_stats(analyser->stats(x));
+
+    // Assemble and factorize the matrix
+    this->factorize(x);
+}
+
+// Discretization of the functions whose averages define the coefficients of
+// the effective equation: a_i, dxa_ij and the adjoint divergence of h, one per column.
+arma::mat Solver_spectral::discretize_functions(vec x) {
+
+    int ns = problem->ns;
 
     // Vector of functions to discretize
     int n_functions = ns + ns*ns + 1;
-    vector<double (*) (vec, vec)> functions(n_functions);
+    vector<void (*) (const double*, const double*, size_t, double*)> functions(n_functions);
     for (int i = 0; i < ns; i++)
-        functions[i] = problem->a[i];
+        functions[i] = problem->a_batch[i];
     for (int i = 0; i < ns; i++) {
         for (int j = 0; j < ns; j++) {
-            functions[ns + i*ns + j] = problem->dxa[i][j];
+            functions[ns + i*ns + j] = problem->dxa_batch[i][j];
         }
     }
-    functions[ns + ns*ns] = problem->stardiv_h;
+    functions[ns + ns*ns] = problem->stardiv_h_batch;
 
     // Discretization of functions in space
-    mat functions_discretized_space(n_functions);
-    for (int i = 0; i < n_functions; ++i)
-        functions_discretized_space[i] = discretize(x, functions[i]);
+    return discretize(x, functions);
+}
 
-    // Discretization of functions in hermite components
-    mat functions_discretized_herm(n_functions);
-    for (int i = 0; i < n_functions; ++i)
-        functions_discretized_herm[i] = project_herm(nf, conf->degree, functions_discretized_space[i], 1);
+// Solution of the linear system restricted to the first rhs.n_rows basis
+// functions, for all the columns of rhs.
+arma::mat Solver_spectral::solve(const arma::mat& rhs, const arma::mat& guess) {
 
-    // Matrix of the linear system
-    mat matrix = compute_matrix(x);
+    int n = rhs.n_rows;
+    arma::mat sol;
 
-    // Solution of the Poisson equation
-    vector<SDE_coeffs> result(degrees.size());
+    if (sparse) {
+        sol = skyline_solve(sparse_factor, rhs);
+    }
+    else if (conf->matrix_free) {
+        sol = conjugate_gradient(diff_discretized, rhs, guess);
+    }
+    else if (factorized) {
+        arma::mat sub_factor = factor.submat(0,0, n-1,n-1);
+        sol = arma::solve(arma::trimatl(sub_factor), rhs);
+        sol = arma::solve(arma::trimatu(sub_factor.t()), sol);
+    }
+    else {
+        sol = arma::solve(matrix.submat(0,0, n-1,n-1), rhs);
+    }
 
-    for (unsigned int i = 0; i < degrees.size(); ++i) {
+    return sol;
+}
 
-        int d = degrees[i];
+// Assemble and factorize the matrix of the linear system at x, or
+// discretize the potential part of the operator for the matrix-free solver.
+void Solver_spectral::factorize(vec x) {
 
-        // Dimension of the space of polynomials of degree lower or equal to i.
-        int n = bin(d + nf, nf);
+    factorization_x = x;
+    factorized = false;
 
-        // Solutions obtained by using polynomials of degree up to i.
-        mat sub_solutions(n_functions);
-        mat sub_functions(n_functions);
+    sparse = conf->exact_polynomial && !problem->lin_poly_exponents.empty();
 
-        // Corresponding submatrix
-        arma::mat sub_matrix = to_arma(matrix).submat(0,0, n-1,n-1);
+    if (sparse) {
+        sparse_factor = polynomial_matrix(x);
+        sparse = skyline_cholesky(sparse_factor);
+        if (!sparse) {
+            cout << "Warning: sparse Cholesky factorization failed, using quadrature" << endl;
+        }
+    }
 
-        for (int j = 0; j < n_functions; ++j) {
-            sub_functions[j] = to_std_vec(to_arma_vec(functions_discretized_herm[j]).subvec(0,n-1));
-            sub_solutions[j] = to_std_vec(arma::solve(sub_matrix, to_arma_vec(sub_functions[j])));
+    if (!sparse && conf->matrix_free) {
+        diff_discretized = to_arma_vec(discretize_linear_terms(x));
+    }
+    else if (!sparse) {
+        matrix = compute_matrix(x);
+        factorized = conf->cholesky && arma::chol(factor, matrix, "lower");
+        if (conf->cholesky && !factorized) {
+            cout << "Warning: Cholesky factorization failed, using dense solver" << endl;
         }
 
-        result[i] = compute_averages(sub_functions, sub_solutions);
+        // Only the dense solver needs the matrix once it is factorized
+        if (factorized) {
+            matrix.reset();
+        }
     }
-    return result;
 }
 
-mat Solver_spectral::compute_matrix(vec x) {
+/*! Exact Galerkin matrix for polynomial linear terms
+ *
+ * When linearTerm is a polynomial in y, the potential part of the operator,
+ * q(z) = gaussian_linear_term(z) - linearTerm(x, Cz + m), is a polynomial in
+ * z, and its matrix in the Hermite basis can be computed exactly. Since
+ * z h_n = sqrt(n+1) h_{n+1} + sqrt(n) h_{n-1}, the matrix of the
+ * multiplication by z^k in the unidimensional basis is the k-th power of the
+ * tridiagonal Jacobi matrix, and in several dimensions it is the tensor
+ * product of these. The matrix is thus banded in each dimension, with
+ * bandwidth the degree of q in that dimension, and is stored in skyline format.
+ */
+skyline Solver_spectral::polynomial_matrix(vec x) {
 
-    // Parameters of the problem
-    int nf = problem->nf;
-    int nb = bin(conf->degree + nf, nf);
+    int degree = conf->degree;
+    int nb = bin(degree + nf, nf);
 
-    // Discretized difference of linear terms
-    mat quad_points = gauss->nodes;
-    vec quad_weights = gauss->weights;
+    // Polynomials in z, as maps from exponents to coefficients
+    typedef map<vector<int>, double> polynomial;
+    auto multiply = [] (const polynomial& p1, const polynomial& p2) -> polynomial {
+        polynomial result;
+        for (auto t1 = p1.begin(); t1 != p1.end(); ++t1)
+            for (auto t2 = p2.begin(); t2 != p2.end(); ++t2)
+                result[t1->first + t2->first] += t1->second * t2->second;
+        return result;
+    };
+
+    vector<int> zero(nf, 0);
+    polynomial q;
+
+    // Linear term of the Gaussian
+    double S = problem->s * problem->s;
+    for (int k = 0; k < nf; ++k) {
+        vector<int> exponent = zero; exponent[k] = 2;
+        q[zero] += 0.25 * S / this->eig_val_cov[k];
+        q[exponent] -= 0.125 * S / this->eig_val_cov[k];
+    }
+
+    // Linear term of the problem, with y = Cz + m
+    for (unsigned int t = 0; t < problem->lin_poly_exponents.size(); ++t) {
+
+        polynomial term;
+        term[zero] = - problem->lin_poly_coeffs[t](x.data(), this->bias.data());
+
+        for (int j = 0; j < nf; ++j) {
+
+            polynomial y_j;
+            y_j[zero] = this->bias[j];
+            for (int k = 0; k < nf; ++k) {
+                vector<int> exponent = zero; exponent[k] = 1;
+                y_j[exponent] += this->sqrt_cov[j][k];
+            }
+
+            for (int p = 0; p < problem->lin_poly_exponents[t][j]; ++p)
+                term = multiply(term, y_j);
+        }
+
+        for (auto it = term.begin(); it != term.end(); ++it)
+            q[it->first] += it->second;
+    }
+
+    // Degree of q in each dimension
+    vector<int> bandwidth(nf, 0);
+    for (auto it = q.begin(); it != q.end(); ++it)
+        for (int k = 0; k < nf; ++k)
+            bandwidth[k] = max(bandwidth[k], it->first[k]);
+    int max_bandwidth = *max_element(bandwidth.begin(), bandwidth.end());
+
+    // Powers of the Jacobi matrix
+    int n_jacobi = degree + max_bandwidth + 1;
+    arma::mat jacobi = arma::zeros<arma::mat>(n_jacobi, n_jacobi);
+    for (int n = 0; n < n_jacobi - 1; ++n)
+        jacobi(n, n+1) = jacobi(n+1, n) = sqrt(n+1);
+
+    vector<arma::mat> powers(max_bandwidth + 1);
+    powers[0] = arma::eye(n_jacobi, n_jacobi);
+    for (int p = 1; p <= max_bandwidth; ++p)
+        powers[p] = powers[p-1] * jacobi;
+
+    // Profile of the matrix
+    auto in_band = [&] (int i, int j) -> bool {
+        for (int k = 0; k < nf; ++k)
+            if (abs(ind2mult[i][k] - ind2mult[j][k]) > bandwidth[k])
+                return false;
+        return true;
+    };
+
+    vector<int> first(nb);
+    #pragma omp parallel for num_threads(resolve_threads(conf->n_threads))
+    for (int i = 0; i < nb; ++i)
+        for (first[i] = 0; !in_band(i, first[i]); ++first[i]) {}
+
+    // Assembly, by rows, whose lengths vary
+    skyline matrix = skyline_alloc(first);
+    arma::vec diagonal = diagonal_term();
+
+    #pragma omp parallel for schedule(dynamic, 16) num_threads(resolve_threads(conf->n_threads))
+    for (int i = 0; i < nb; ++i) {
+        for (int j = first[i]; j <= i; ++j) {
+
+            if (!in_band(i,j))
+                continue;
+
+            for (auto it = q.begin(); it != q.end(); ++it) {
+                double product = it->second;
+                for (int k = 0; k < nf; ++k)
+                    product *= powers[it->first[k]](ind2mult[i][k], ind2mult[j][k]);
+                matrix(i,j) += product;
+            }
+        }
+        matrix(i,i) += diagonal(i);
+    }
+
+    return matrix;
+}
+
+/*! Discretize the potential part of the operator
+ *
+ * Difference between the linear term of the Schrodinger operator associated
+ * with the Gaussian and that of the problem, multiplied by the quadrature weights.
+ */
+vec Solver_spectral::discretize_linear_terms(vec x) {
 
     int ni = gauss->weights.size();
-    vec diff_discretized(ni, 1.);
+    vec diff_discretized(ni);
 
+    // Linear term of the problem at all the nodes
+    dense_mat ys = gauss->map_nodes(this->sqrt_cov, this->bias);
+    evaluate_batch(problem->linearTerm_batch, x.data(), ys, 1, diff_discretized.data(), conf->n_threads);
+
+    #pragma omp parallel for num_threads(resolve_threads(conf->n_threads))
     for (int j = 0; j < ni; ++j) {
+        diff_discretized[j] = gaussian_linear_term(gauss->nodes.colptr(j)) - diff_discretized[j];
+        diff_discretized[j] *= gauss->weights[j];
+    }
+
+    return diff_discretized;
+}
+
+/*! Diagonal part of the operator
+ *
+ * The Ornstein-Uhlenbeck part of the operator is diagonal in the Hermite
+ * basis, with eigenvalues given in terms of the multi-indices.
+ */
+arma::vec Solver_spectral::diagonal_term() {
 
-        vec z = quad_points[j];
-        vec y = map_to_real(z);
+    int nb = bin(conf->degree + nf, nf);
 
-        diff_discretized[j] = gaussian_linear_term(z) - problem->linearTerm(x,y);
-        diff_discretized[j] *= quad_weights[j];
+    arma::vec diagonal = arma::zeros<arma::vec>(nb);
+    for (int i = 0; i < nb; ++i) {
+        for (int j = 0; j < nf; ++j) {
+            diagonal(i) += ind2mult[i][j] / this->eig_val_cov[j] * (problem->s * problem->s) / 2;
+        }
+    }
+
+    return diagonal;
+}
+
+arma::mat Solver_spectral::compute_matrix(vec x) {
+
+    // Parameters of the problem
+    int nf = problem->nf;
+    int nb = bin(conf->degree + nf, nf);
+
+    // Discretized difference of linear terms
+    vec diff_discretized = discretize_linear_terms(x);
+
+    // Weighted Gram matrix of the Hermite polynomials at the nodes, V^T D V,
+    // accumulated over blocks of nodes so that only one block of V is
+    // scaled at a time, instead of a copy of V.
+    if (conf->vandermonde) {
+        arma::mat matrix;
+        if (tensor)
+            matrix = tensor_matrix(to_arma_vec(diff_discretized));
+        else {
+            size_t ni = hermite_nodes.n_rows;
+            matrix = arma::zeros<arma::mat>(nb, nb);
+            arma::mat block, scaled;
+            for (size_t b = 0; b < n_blocks(ni); ++b) {
+                size_t first = b*block_size, last = min(ni, first + block_size) - 1;
+                block = hermite_nodes.rows(first, last);
+                scaled = block;
+                for (int j = 0; j < nb; ++j)
+                    for (size_t k = 0; k < block.n_rows; ++k)
+                        scaled(k,j) *= diff_discretized[first + k];
+                matrix += block.t() * scaled;
+            }
+        }
+
+        arma::vec diagonal = diagonal_term();
+        for (int i = 0; i < nb; ++i)
+            matrix(i,i) += diagonal(i);
+
+        return matrix;
     }
 
     // Projection against monomials
     vec tmp_vec = project_mon(nf, 2*conf->degree, diff_discretized, 0);
 
     // Generating Galerkin matrix based on these
-    mat prod_mat(nb, vec(nb, 0.));
+    arma::mat prod_mat(nb, nb);
 
+    #pragma omp parallel for num_threads(resolve_threads(conf->n_threads))
     for (int i = 0; i < nb; ++i) {
-        vector<int> m1 = ind2mult[i];
         for (int j = 0; j < nb; ++j) {
-            vector<int> m2 = ind2mult[j];
-            int index = mult2ind[m1 + m2];
-            prod_mat[i][j] = tmp_vec[index];
+            prod_mat(i,j) = tmp_vec[ind2mult.rank_sum(i,j)];
         }
     }
 
-    mat tmp_mat(nb, vec(nb, 0.));
-    mat matrix(nb, vec(nb, 0.));
+    // Change of basis from monomials to Hermite polynomials, on both sides
+    arma::mat matrix = mon_to_herm(prod_mat);
+    matrix = mon_to_herm(matrix.t());
+
     for (int i = 0; i < nb; ++i) {
-        for (int j = 0; j < nb; ++j) {
-            for (int k = 0; k < nb; ++k) {
-                tmp_mat[i][j] += hermiteCoeffs_nd[j][k]*prod_mat[i][k];
-            }
+        const int* m1 = ind2mult[i];
+        for (int j = 0; j < nf; ++j) {
+            matrix(i,i) += m1[j] / this->eig_val_cov[j] * (problem->s * problem->s) / 2;
         }
     }
 
-    for (int i = 0; i < nb; ++i) {
-        vector<int> m1 = ind2mult[i];
+    return matrix;
+}
 
-        for (int j = 0; j < nf; ++j) {
-            matrix[i][i] += m1[j] / this->eig_val_cov[j] * (problem->s * problem->s) / 2;
+/*! Apply the operator to a set of coefficients
+ *
+ * Product of the Galerkin matrix restricted to the first coefficients.rows
+ * polynomials with each column of the argument, computed through the
+ * quadrature without assembling the matrix.
+ */
+arma::mat Solver_spectral::apply_operator(const arma::vec& diff_discretized, const arma::mat& coefficients) {
+
+    int nb = bin(conf->degree + nf, nf);
+    int n = coefficients.n_rows;
+
+    arma::mat padded = arma::zeros<arma::mat>(nb, coefficients.n_cols);
+    padded.rows(0, n-1) = coefficients;
+
+    // Potential part, V^T D V
+    arma::mat values = herm_to_nodes(padded);
+    values.each_col() %= diff_discretized;
+    arma::mat result = nodes_to_herm(values).rows(0, n-1);
+
+    // Diagonal part
+    arma::vec diagonal = diagonal_term();
+    for (unsigned int j = 0; j < coefficients.n_cols; ++j) {
+        for (int i = 0; i < n; ++i) {
+            result(i,j) += diagonal(i) * coefficients(i,j);
         }
-        for (int j = 0; j <= i; ++j) {
-            for (int k = 0; k < nb; ++k) {
-                matrix[i][j] += hermiteCoeffs_nd[i][k]*tmp_mat[k][j];
+    }
+
+    return result;
+}
+
+/*! Preconditioned conjugate gradient for several right-hand sides
+ *
+ * The iterations for all the right-hand sides are carried out together, so
+ * that the operator is applied once per iteration to a block of vectors. The
+ * preconditioner is the diagonal Ornstein-Uhlenbeck part of the operator,
+ * whose zero eigenvalue, for the constant polynomial, is replaced by the
+ * smallest nonzero one.
+ */
+arma::mat Solver_spectral::conjugate_gradient(const arma::vec& diff_discretized, const arma::mat& rhs, arma::mat solution) {
+
+    int n = rhs.n_rows;
+    int n_rhs = rhs.n_cols;
+
+    // Diagonal preconditioner
+    arma::vec preconditioner = diagonal_term().rows(0, n-1);
+    double gap = (problem->s * problem->s) / 2 / arma::max(arma::vec(eig_val_cov));
+    preconditioner(0) = gap;
+
+    arma::mat residual = rhs - apply_operator(diff_discretized, solution);
+    arma::mat precond_residual = residual.each_col() / preconditioner;
+    arma::mat direction = precond_residual;
+
+    vector<double> rz(n_rhs), rhs_norm(n_rhs);
+    vector<bool> converged(n_rhs);
+    for (int j = 0; j < n_rhs; ++j) {
+        rz[j] = arma::dot(residual.col(j), precond_residual.col(j));
+        rhs_norm[j] = arma::norm(rhs.col(j));
+        converged[j] = arma::norm(residual.col(j)) <= conf->cg_tolerance * rhs_norm[j];
+    }
+
+    for (int iter = 0; iter < conf->cg_max_iterations; ++iter) {
+
+        if (std::all_of(converged.begin(), converged.end(), [] (bool c) { return c; }))
+            break;
+
+        arma::mat image = apply_operator(diff_discretized, direction);
+
+        for (int j = 0; j < n_rhs; ++j) {
+
+            if (converged[j])
+                continue;
+
+            double alpha = rz[j] / arma::dot(direction.col(j), image.col(j));
+            solution.col(j) += alpha * direction.col(j);
+            residual.col(j) -= alpha * image.col(j);
+
+            if (arma::norm(residual.col(j)) <= conf->cg_tolerance * rhs_norm[j]) {
+                converged[j] = true;
+                continue;
             }
-            matrix[j][i] = matrix[i][j];
+
+            precond_residual.col(j) = residual.col(j) / preconditioner;
+            double rz_new = arma::dot(residual.col(j), precond_residual.col(j));
+            direction.col(j) = precond_residual.col(j) + (rz_new / rz[j]) * direction.col(j);
+            rz[j] = rz_new;
         }
     }
 
-    return matrix;
+    if (!std::all_of(converged.begin(), converged.end(), [] (bool c) { return c; })) {
+        cout << "Warning: conjugate gradient did not converge" << endl;
+    }
+
+    return solution;
 }
 
 /*! Function to calculate the effective coefficients
@@ -147,10 +520,17 @@ mat Solver_spectral::compute_matrix(vec x) {
  * This function calculates the homogenized coefficients from the solution of
  * the cell problem, and the discretization of the coefficients in hermite functions.
  */
-SDE_coeffs Solver_spectral::compute_averages(const mat& functions, const mat& solutions) {
+SDE_coeffs Solver_spectral::compute_averages(const arma::mat& functions_herm, const arma::mat& solutions_herm) {
 
     int ns = problem->ns;
 
+    mat functions(functions_herm.n_cols);
+    mat solutions(solutions_herm.n_cols);
+    for (unsigned int j = 0; j < functions_herm.n_cols; ++j) {
+        functions[j] = to_std_vec(functions_herm.col(j));
+        solutions[j] = to_std_vec(solutions_herm.col(j));
+    }
+
     mat coeffs(ns);
     mat sol(ns);
     cube coeffs_dx(ns, mat(ns));
@@ -217,7 +597,7 @@ SDE_coeffs Solver_spectral::compute_averages(const mat& functions, const mat& so
  *
  * TODO: add description (urbain, Thu 25 Jun 2015 01:27:09 CEST)
  */
-double Solver_spectral::gaussian_linear_term(vec z) {
+double Solver_spectral::gaussian_linear_term(const double* z) {
 
     // Laplacian term.
     double laplacian = 0.;
@@ -238,45 +618,22 @@ double Solver_spectral::gaussian_linear_term(vec z) {
     return (0.25 * S * laplacian - 0.125 * S * grad2);
 }
 
-/*! Change of variable y = Cz + m
- *
- * This function implements the change of variables y = Cz + m.. If z is
- * distributed as G(0,I), y will be distributed as G(CC^T,m).
- */
-vec Solver_spectral::map_to_real(vec z) {
-
-    // Initialization
-    vec result(z.size(), 0.);
-
-    for (unsigned int i = 0; i < z.size(); ++i) {
-
-        // Left-multiply z by covariance matrix
-        for (unsigned int j = 0; j < z.size(); ++j) {
-            result[i] += this->sqrt_cov[i][j] * z[j];
-        }
-
-        // Add bias
-        result[i] += this->bias[i];
-    }
-
-    return result;
-}
-
 /*! Update the statistics of the Gaussian related to Hermite functions
  *
  * This function updates the statistics of the Gaussian from which the Hermite
  * functions are calculated. In simple words, the Hermite functions are
  * concentrated where the density of the Gaussian is non-zero.
  */
-void Solver_spectral::update_stats() {
+void Solver_spectral::update_stats(const analyser_stats& stats) {
 
     // Scaling for covariant matrix
     vec var_scaling = conf->scaling;
 
-    // Update of bias and covariance
-    this->bias = analyser->bias;
-    this->eig_vec_cov = analyser->eig_vec_cov;
-    this->eig_val_cov = analyser->eig_val_cov;
+    // Update of bias, covariance and normalization
+    this->bias = stats.bias;
+    this->eig_vec_cov = stats.eig_vec_cov;
+    this->eig_val_cov = stats.eig_val_cov;
+    this->normalization = stats.normalization;
 
     // Apply user-defined extra-scaling
     for (int i = 0; i < nf; ++i) {
@@ -298,36 +655,41 @@ void Solver_spectral::update_stats() {
     }
 }
 
-vec Solver_spectral::discretize(vec x, double(*f)(vec, vec )) {
+/*! Discretization of several functions at the quadrature nodes
+ *
+ * The nodes are mapped to the original variables once, and each function is
+ * evaluated at all the nodes with a single call to its batched version. The
+ * factor sqrt(rho/gaussian) * weight, common to all the functions, is
+ * computed once per node. The result has one row per node and one column per
+ * function.
+ */
+arma::mat Solver_spectral::discretize(vec x, const vector<void (*) (const double*, const double*, size_t, double*)>& functions) {
 
-    // Number of integration points
+    // Number of integration points and of functions
     int ni = gauss->weights.size();
+    int n_functions = functions.size();
 
-    // Weights and points of the integrator.
-    mat quad_points = gauss->nodes;
-    vec quad_weights = gauss->weights;
+    arma::mat f_discretized(ni, n_functions);
 
-    // Discretization of a at gridpoints
-    vec f_discretized(ni, 1.);
+    // Integration points in the original variables, one per row
+    dense_mat ys = gauss->map_nodes(this->sqrt_cov, this->bias);
 
-    // Computation of the function to integrate at the gridpoints.
-    for (int j = 0; j < ni; ++j) {
+    // Scaling to pass to Schrodinger equation, scaling needed for the
+    // integration, and weight of the integration
+    vec factor(ni);
+    evaluate_batch(problem->zrho_batch, x.data(), ys, 1, factor.data(), conf->n_threads);
 
-        // Integration point and rescaled version for integrattion
-        vec z = quad_points[j];
-        vec y = map_to_real(z);
+    #pragma omp parallel for num_threads(resolve_threads(conf->n_threads))
+    for (int j = 0; j < ni; ++j)
+        factor[j] = sqrt(factor[j] / (this->normalization * gaussian(gauss->nodes.colptr(j), nf))) * gauss->weights[j];
 
-        // Scaling to pass to Schrodinger equation;
-        f_discretized[j] *= sqrt(analyser->rho(x,y));
+    for (int i = 0; i < n_functions; ++i) {
+        double* column = f_discretized.colptr(i);
+        evaluate_batch(functions[i], x.data(), ys, 1, column, conf->n_threads);
 
-        // Scaling needed for the integration;
-        f_discretized[j] /= sqrt(gaussian(z));
-
-        // Discretization of a
-        f_discretized[j] *= f(x,y);
-
-        // Weight of the integration
-        f_discretized[j] *= quad_weights[j];
+        #pragma omp parallel for num_threads(resolve_threads(conf->n_threads))
+        for (int j = 0; j < ni; ++j)
+            column[j] *= factor[j];
     }
 
     return f_discretized;
@@ -341,60 +703,47 @@ vec Solver_spectral::project_mon(int nf, int degree, vec f_discretized, int resc
     // Number of integration points
     int ni = gauss->weights.size();
 
-    // Nodes of the gaussian quadrature
-    mat quad_points = gauss->nodes;
-
     // Vector of coefficients of the projection
     vec coefficients(nb, 0.);
 
-    // Vector of multi-indices
-    vector< vector<int> > m(nb);
-
     // Vector of mapped indices of lower degrees
     vector<int> mi(nb);
 
     // Nonzero element in m - mapped_m
     vector<int> delta(nb);
 
-    for (int i = 0; i < nb; ++i) {
+    for (int i = 1; i < nb; ++i) {
 
-        // Multi-index associated with j
-        m[i] = ind2mult[i];
-
-        // Mapping that associates for each multi-index one of lower degree.
-        for (delta[i] = 0; i != 0 && m[i][delta[i]] == 0; ++delta[i]) {}
-
-        // Initialization of mapped multi-index
-        vector<int> mm = m[i];
-
-        // Decrease degree by 1
-        mm[delta[i]] --;
-
-        // Mapped linear index
-        mi[i] = mult2ind[mm];
+        // Mapping that associates for each multi-index one of lower degree,
+        // obtained by decreasing its first nonzero component.
+        for (delta[i] = 0; ind2mult[i][delta[i]] == 0; ++delta[i]) {}
+        mi[i] = ind2mult.predecessor(i, delta[i]);
     }
 
-    // Loop over the points of the quadrature
-    for (int i = 0; i < ni; ++i) {
-
-        // Quadrature point
-        vec quad_point = quad_points[i];
+    // Loop over the points of the quadrature, by blocks
+    blocked_reduce(ni, nb, coefficients.data(), [&] (size_t first, size_t last, double* partial) {
 
         // Evaluate monomials in point
         vec mon_val(nb, 1.);
 
-        // Evaluation by incrementation of the degree
-        for (int j = 1; j < nb; ++j) {
-            mon_val[j] = mon_val[mi[j]] * quad_point[delta[j]];
-        }
+        for (size_t i = first; i < last; ++i) {
 
-        // Loop over all the monomials
-        for (int j = 0; j < nb; ++j) {
+            // Quadrature point
+            const double* quad_point = gauss->nodes.colptr(i);
+
+            // Evaluation by incrementation of the degree
+            for (int j = 1; j < nb; ++j) {
+                mon_val[j] = mon_val[mi[j]] * quad_point[delta[j]];
+            }
+
+            // Loop over all the monomials
+            for (int j = 0; j < nb; ++j) {
 
-            // Update coefficient
-            coefficients[j] += f_discretized[i] * mon_val[j];
+                // Update coefficient
+                partial[j] += f_discretized[i] * mon_val[j];
+            }
         }
-    }
+    }, conf->n_threads);
 
     // Scaling due to change of variable
     for (int i = 0; i < nb && rescale; ++i) {
@@ -405,7 +754,137 @@ vec Solver_spectral::project_mon(int nf, int degree, vec f_discretized, int resc
 }
 
 vec Solver_spectral::project_herm(int nf, int degree, vec f_discretized, int rescale) {
-    return hermiteCoeffs_nd * project_mon(nf, degree, f_discretized, rescale);
+    return to_std_vec(mon_to_herm(to_arma_vec(project_mon(nf, degree, f_discretized, rescale))));
+}
+
+/*! Change of basis from monomials to Hermite polynomials
+ *
+ * Row i of the argument is indexed by the multi-index of rank i. The matrix
+ * of the change of basis is the Kronecker product of the unidimensional
+ * matrices, restricted to the multi-indices of degree at most the degree of
+ * the basis. Since the unidimensional matrices are lower triangular, it is
+ * applied one dimension at a time, without being formed: in dimension k,
+ * the entry of multi-index m receives the contributions of the entries
+ * obtained by decreasing m_k by an even number, which are found by following
+ * the predecessors of m in that direction.
+ */
+arma::mat Solver_spectral::mon_to_herm(const arma::mat& coefficients) {
+
+    int nb = coefficients.n_rows;
+    int n_cols = coefficients.n_cols;
+
+    arma::mat result = coefficients;
+    arma::mat transformed(nb, n_cols);
+
+    for (int k = 0; k < nf; ++k) {
+        #pragma omp parallel for num_threads(resolve_threads(conf->n_threads))
+        for (int i = 0; i < nb; ++i) {
+
+            int p = ind2mult[i][k];
+            for (int c = 0; c < n_cols; ++c)
+                transformed(i,c) = hermiteCoeffs_1d[p][p] * result(i,c);
+
+            int j = i;
+            for (int q = p - 1; q >= 0; --q) {
+                j = ind2mult.predecessor(j, k);
+                if ((p - q) % 2 == 0)
+                    for (int c = 0; c < n_cols; ++c)
+                        transformed(i,c) += hermiteCoeffs_1d[p][q] * result(j,c);
+            }
+        }
+        std::swap(result, transformed);
+    }
+
+    return result;
+}
+
+/*! Project discretized functions on Hermite polynomials
+ *
+ * Each column of the argument contains the values of a function at the
+ * quadrature nodes, multiplied by the quadrature weights. When the values of
+ * the Hermite polynomials at the nodes are available, the projection of all
+ * the functions amounts to a single matrix-matrix product.
+ */
+arma::mat Solver_spectral::project_herm(const arma::mat& f_discretized) {
+
+    // Number of polynomials
+    int nb = bin(conf->degree + nf, nf);
+
+    if (!conf->vandermonde) {
+        arma::mat result(nb, f_discretized.n_cols);
+        for (unsigned int i = 0; i < f_discretized.n_cols; ++i) {
+            vec f_i = to_std_vec(f_discretized.col(i));
+            result.col(i) = to_arma_vec(project_herm(nf, conf->degree, f_i, 1));
+        }
+        return result;
+    }
+
+    // Scaling due to change of variable
+    return nodes_to_herm(f_discretized) * sqrt(sqrt(det_cov));
+}
+
+arma::mat Solver_spectral::nodes_to_herm(const arma::mat& f_nodes) {
+
+    if (tensor)
+        return tensor_project(f_nodes);
+
+    if (!hermite_nodes.is_empty())
+        return hermite_nodes.t() * f_nodes;
+
+    // Without stored values, evaluate the polynomials at one node at a time
+    int nb = bin(conf->degree + nf, nf);
+    int ni = gauss->weights.size();
+
+    arma::mat result = arma::zeros<arma::mat>(nb, f_nodes.n_cols);
+
+    // Partial results have the layout of result
+    blocked_reduce(ni, nb * f_nodes.n_cols, result.memptr(), [&] (size_t first, size_t last, double* partial) {
+        arma::vec values(nb);
+        vector<double> work(nf * (conf->degree + 1));
+        for (size_t i = first; i < last; ++i) {
+            hermite_node(i, values, work);
+            for (unsigned int j = 0; j < f_nodes.n_cols; ++j) {
+                for (int k = 0; k < nb; ++k) {
+                    partial[k + j*nb] += values(k) * f_nodes(i,j);
+                }
+            }
+        }
+    }, conf->n_threads);
+
+    return result;
+}
+
+arma::mat Solver_spectral::herm_to_nodes(const arma::mat& coefficients) {
+
+    if (tensor)
+        return tensor_evaluate(coefficients);
+
+    if (!hermite_nodes.is_empty())
+        return hermite_nodes * coefficients;
+
+    // Without stored values, evaluate the polynomials at one node at a time
+    int nb = bin(conf->degree + nf, nf);
+    int ni = gauss->weights.size();
+
+    arma::mat result = arma::zeros<arma::mat>(ni, coefficients.n_cols);
+
+    #pragma omp parallel num_threads(resolve_threads(conf->n_threads))
+    {
+        arma::vec values(nb);
+        vector<double> work(nf * (conf->degree + 1));
+
+        #pragma omp for schedule(static)
+        for (int i = 0; i < ni; ++i) {
+            hermite_node(i, values, work);
+            for (unsigned int j = 0; j < coefficients.n_cols; ++j) {
+                for (int k = 0; k < nb; ++k) {
+                    result(i,j) += values(k) * coefficients(k,j);
+                }
+            }
+        }
+    }
+
+    return result;
 }
 
 /*! Constructor of the spectral solver
@@ -426,629 +905,326 @@ Solver_spectral::Solver_spectral(Problem *p, Analyser *a, config_spectral* confi
     nf = problem->nf;
     ns = problem->ns;
 
-    // Integrator
-    gauss = new Gaussian_integrator(conf->n_nodes, nf);
-
-    // Weights and points of the integrator.
-    mat quad_points = gauss->nodes;
-    vec quad_weights = gauss->weights;
+    // Integrator. Sum factorization on the full grid is faster than the
+    // dense kernels on the pruned grid, so the grid is only pruned without it.
+    bool sum_factorization = conf->vandermonde && conf->sum_factorization && conf->n_nodes != 0;
+    gauss = Gaussian_integrator::cached(conf->n_nodes, nf, sum_factorization ? 0. : conf->prune);
 
     // Initialize multi-indices
-    ind2mult = lower_multi_indices(nf, 2*conf->degree);
-    for (unsigned int i = 0; i < ind2mult.size(); ++i) {
-        mult2ind.emplace(ind2mult[i], i);
+    ind2mult = Multi_indices(nf, 2*conf->degree);
+
+    // Matrix that will contain the coefficients of the unidimensional Hermite
+    // polynomials, only needed when going through monomials. The
+    // multi-dimensional coefficients are their tensor products, applied by
+    // mon_to_herm.
+    if (!conf->vandermonde) {
+        mat mat1d (conf->degree + 1, vec(conf->degree + 1,0.));
+        hermite_coefficients(conf->degree, mat1d);
+        this->hermiteCoeffs_1d = mat1d;
     }
 
-    // Dimension of the approximation space
-    int nb = bin(conf->degree + problem->nf, problem->nf);
-
-    // Matrices that will contain the coefficients of the 1- and multi- dimensional
-    // Hermite polynomials
-    mat mat1d (conf->degree + 1, vec(conf->degree + 1,0.));
-    mat matnd(nb, vec(nb,0.));
-
-    // Fill the matrix for the unidimensional coefficients.
-    hermite_coefficients(conf->degree, mat1d);
+    // Values of the Hermite polynomials at the nodes, which don't depend on x.
+    // The matrix-free solver evaluates them on the fly on unstructured grids.
+    tensor = conf->vandermonde && conf->sum_factorization && gauss->tensor;
+    if (tensor)
+        tensor_tables(conf->degree);
+    else if (conf->vandermonde && !conf->matrix_free)
+        hermite_vandermonde(conf->degree, hermite_nodes);
+}
 
-    // Calculate the multi-dimensional coefficients by tensor products.
-    for (int i = 0; i < nb; ++i) {
+/*! Evaluate unidimensional Hermite polynomials
+ *
+ * The orthonormal Hermite polynomials are evaluated with the three-term
+ * recurrence h_{n+1}(z) = (z h_n(z) - sqrt(n) h_{n-1}(z))/sqrt(n+1).
+ */
+void Solver_spectral::hermite_values (int degree, double z, vec& values) {
+    values[0] = 1.;
+    if (degree >= 1)
+        values[1] = z;
+    for (int n = 1; n < degree; ++n)
+        values[n+1] = (z*values[n] - sqrt(n)*values[n-1])/sqrt(n+1);
+}
 
-        // Multi-index corresponding to linear index i
-        vector<int> m1 = ind2mult[i];
+/*! Values of the first nb polynomials of the basis at a point
+ *
+ * The value of polynomial j is written to values[j*stride]. The array work,
+ * of size nf*(degree + 1), receives the values of the unidimensional
+ * polynomials. NF is the number of dimensions when it is known at compile
+ * time, in which case the loops over the dimensions are unrolled, or 0.
+ */
+template<int NF> void Solver_spectral::hermite_point_nf (int degree, const double* z, int nb, double* values, size_t stride, double* work) {
 
-        for (int j = 0; j < nb; ++j) {
+    const int n = (NF > 0) ? NF : nf;
 
-            // Multi-index corresponding to linear index j
-            vector<int> m2 = ind2mult[j];
+    for (int k = 0; k < n; ++k) {
+        double* values_1d = work + k*(degree + 1);
+        values_1d[0] = 1.;
+        if (degree >= 1)
+            values_1d[1] = z[k];
+        for (int p = 1; p < degree; ++p)
+            values_1d[p+1] = (z[k]*values_1d[p] - sqrt(p)*values_1d[p-1])/sqrt(p+1);
+    }
 
-            // Calculation of the coefficients of x^m2 in h^m1
-            matnd[i][j] = 1.;
+    for (int j = 0; j < nb; ++j) {
+        const int* m = ind2mult[j];
+        double result = 1.;
+        for (int k = 0; k < n; ++k)
+            result *= work[k*(degree + 1) + m[k]];
+        values[j*stride] = result;
+    }
+}
 
-            for (int k = 0; k < problem->nf; ++k) {
-                matnd[i][j] *= mat1d[m1[k]][m2[k]];
-            }
-        }
+// Dispatch to the versions specialized for the usual dimensions
+void Solver_spectral::hermite_point (int degree, const double* z, int nb, double* values, size_t stride, double* work) {
+    switch (nf) {
+        case 1: hermite_point_nf<1>(degree, z, nb, values, stride, work); break;
+        case 2: hermite_point_nf<2>(degree, z, nb, values, stride, work); break;
+        case 3: hermite_point_nf<3>(degree, z, nb, values, stride, work); break;
+        case 4: hermite_point_nf<4>(degree, z, nb, values, stride, work); break;
+        default: hermite_point_nf<0>(degree, z, nb, values, stride, work);
     }
+}
 
-    // Initialize variables of the solver
-    this->hermiteCoeffs_1d = mat1d;
-    this->hermiteCoeffs_nd = matnd;
+// Values of all the polynomials of the basis at node i.
+void Solver_spectral::hermite_node (int i, arma::vec& values, std::vector<double>& work) {
+    hermite_point(conf->degree, gauss->nodes.colptr(i), values.n_elem, values.memptr(), 1, work.data());
 }
 
-/*! Function to compute hermite coefficients
+/*! Evaluate Hermite polynomials at the quadrature nodes
  *
- * This fills the matrix passed in argument with the hermite coefficients of
- * degree 0 to the degree passed to the method. The coefficients on the first
- * line represent the coefficients of the.
+ * The multi-dimensional polynomials are obtained as tensor products of the
+ * unidimensional ones. Row i of the result contains the values of all the
+ * polynomials at node i.
  */
-void Solver_spectral::hermite_coefficients (int degree, mat& matrix) {
+void Solver_spectral::hermite_vandermonde (int degree, arma::mat& values) {
 
-    if (degree >= 0) {
-        matrix[0][0] = 1.0;
-    }
+    // Number of polynomials
+    int nb = bin(degree + nf, nf);
 
-    if (degree >= 1) {
-        matrix[1][1] = 1.0;
-    }
+    // Number of integration points
+    int ni = gauss->weights.size();
 
-    if (degree >= 2) {
-        matrix[2][0] = sqrt(2.0)*(-1.0/2.0);
-        matrix[2][2] = sqrt(2.0)*(1.0/2.0);
-    }
+    values = arma::mat(ni, nb);
 
-    if (degree >= 3) {
-        matrix[3][1] = sqrt(6.0)*(-1.0/2.0);
-        matrix[3][3] = sqrt(6.0)*(1.0/6.0);
-    }
+    #pragma omp parallel num_threads(resolve_threads(conf->n_threads))
+    {
+        // Values of the unidimensional polynomials in each direction
+        vector<double> work(nf * (degree + 1));
 
-    if (degree >= 4) {
-        matrix[4][0] = sqrt(6.0)*(1.0/4.0);
-        matrix[4][2] = sqrt(6.0)*(-1.0/2.0);
-        matrix[4][4] = sqrt(6.0)*(1.0/1.2E1);
+        #pragma omp for schedule(static)
+        for (int i = 0; i < ni; ++i)
+            hermite_point(degree, gauss->nodes.colptr(i), nb, values.memptr() + i, ni, work.data());
     }
+}
 
-    if (degree >= 5) {
-        matrix[5][1] = sqrt(3.0E1)*(1.0/4.0);
-        matrix[5][3] = sqrt(3.0E1)*(-1.0/6.0);
-        matrix[5][5] = sqrt(3.0E1)*(1.0/6.0E1);
-    }
+/*! Tables for the sum-factorized kernels
+ *
+ * On a tensor grid, the quadrature nodes are the tensor product of n
+ * unidimensional nodes, and the Hermite polynomials are tensor products of
+ * unidimensional polynomials. Sums over the nodes can then be carried out one
+ * dimension at a time, by contracting against the table of unidimensional
+ * polynomials at the unidimensional nodes. After k contractions, the
+ * intermediate results are indexed by the multi-indices of dimension k and
+ * degree at most the degree of the basis, which are extended by one
+ * component at each step using the tables computed here.
+ */
+void Solver_spectral::tensor_tables (int degree) {
 
-    if (degree >= 6) {
-        matrix[6][0] = sqrt(5.0)*(-1.0/4.0);
-        matrix[6][2] = sqrt(5.0)*(3.0/4.0);
-        matrix[6][4] = sqrt(5.0)*(-1.0/4.0);
-        matrix[6][6] = sqrt(5.0)*(1.0/6.0E1);
-    }
+    int n = gauss->nodes_1d.size();
 
-    if (degree >= 7) {
-        matrix[7][1] = sqrt(3.5E1)*(-1.0/4.0);
-        matrix[7][3] = sqrt(3.5E1)*(1.0/4.0);
-        matrix[7][5] = sqrt(3.5E1)*(-1.0/2.0E1);
-        matrix[7][7] = sqrt(3.5E1)*(1.0/4.2E2);
+    // Unidimensional Hermite polynomials at the unidimensional nodes
+    hermite_nodes_1d = arma::mat(n, degree + 1);
+    vec values(degree + 1, 0.);
+    for (int i = 0; i < n; ++i) {
+        hermite_values(degree, gauss->nodes_1d[i], values);
+        for (int j = 0; j <= degree; ++j)
+            hermite_nodes_1d(i,j) = values[j];
     }
 
-    if (degree >= 8) {
-        matrix[8][0] = sqrt(7.0E1)*(1.0/1.6E1);
-        matrix[8][2] = sqrt(7.0E1)*(-1.0/4.0);
-        matrix[8][4] = sqrt(7.0E1)*(1.0/8.0);
-        matrix[8][6] = sqrt(7.0E1)*(-1.0/6.0E1);
-        matrix[8][8] = sqrt(7.0E1)*5.952380952380952E-4;
-    }
+    // Multi-indices of dimension k, starting with the empty multi-index
+    Multi_indices lower(0, degree);
 
-    if (degree >= 9) {
-        matrix[9][1] = sqrt(7.0E1)*(3.0/1.6E1);
-        matrix[9][3] = sqrt(7.0E1)*(-1.0/4.0);
-        matrix[9][5] = sqrt(7.0E1)*(3.0/4.0E1);
-        matrix[9][7] = sqrt(7.0E1)*(-1.0/1.4E2);
-        matrix[9][9] = sqrt(7.0E1)*1.984126984126984E-4;
-    }
+    extensions = vector< vector<int> > (nf);
+    vector<int> extended(nf);
+    for (int k = 0; k < nf; ++k) {
 
-    if (degree >= 10) {
-        matrix[10][0] = sqrt(7.0)*(-3.0/1.6E1);
-        matrix[10][2] = sqrt(7.0)*(1.5E1/1.6E1);
-        matrix[10][4] = sqrt(7.0)*(-5.0/8.0);
-        matrix[10][6] = sqrt(7.0)*(1.0/8.0);
-        matrix[10][8] = sqrt(7.0)*(-1.0/1.12E2);
-        matrix[10][10] = sqrt(7.0)*1.984126984126984E-4;
-    }
+        Multi_indices upper(k + 1, degree);
 
-    if (degree >= 11) {
-        matrix[11][1] = sqrt(7.7E1)*(-3.0/1.6E1);
-        matrix[11][3] = sqrt(7.7E1)*(5.0/1.6E1);
-        matrix[11][5] = sqrt(7.7E1)*(-1.0/8.0);
-        matrix[11][7] = sqrt(7.7E1)*(1.0/5.6E1);
-        matrix[11][9] = sqrt(7.7E1)*(-9.920634920634921E-4);
-        matrix[11][11] = sqrt(7.7E1)*1.803751803751804E-5;
-    }
+        extensions[k] = vector<int> (lower.size * (degree + 1), -1);
+        for (size_t i = 0; i < lower.size; ++i) {
+            copy(lower[i], lower[i] + k, extended.begin());
+            for (int m = 0; m <= degree - lower.degree_of(i); ++m) {
+                extended[k] = m;
+                extensions[k][i*(degree + 1) + m] = upper.rank(extended.data());
+            }
+        }
 
-    if (degree >= 12) {
-        matrix[12][0] = sqrt(2.31E2)*(1.0/3.2E1);
-        matrix[12][2] = sqrt(2.31E2)*(-3.0/1.6E1);
-        matrix[12][4] = sqrt(2.31E2)*(5.0/3.2E1);
-        matrix[12][6] = sqrt(2.31E2)*(-1.0/2.4E1);
-        matrix[12][8] = sqrt(2.31E2)*(1.0/2.24E2);
-        matrix[12][10] = sqrt(2.31E2)*(-1.984126984126984E-4);
-        matrix[12][12] = sqrt(2.31E2)*3.006253006253006E-6;
+        lower = upper;
     }
+}
 
-    if (degree >= 13) {
-        matrix[13][1] = 5.479963503528103E1*(1.0/3.2E1);
-        matrix[13][3] = 5.479963503528103E1*(-1.0/1.6E1);
-        matrix[13][5] = 5.479963503528103E1*(1.0/3.2E1);
-        matrix[13][7] = 5.479963503528103E1*(-1.0/1.68E2);
-        matrix[13][9] = 5.479963503528103E1*4.96031746031746E-4;
-        matrix[13][11] = 5.479963503528103E1*(-1.803751803751804E-5);
-        matrix[13][13] = 5.479963503528103E1*2.312502312502313E-7;
-    }
+/*! Sum-factorized projection on Hermite polynomials
+ *
+ * Equivalent to hermite_nodes.t() * f_discretized. The array being contracted
+ * is stored with one column per multi-index of the dimensions already
+ * contracted; each column contains the remaining node indices, the first
+ * remaining dimension varying fastest, followed by the function index.
+ */
+arma::mat Solver_spectral::tensor_project (const arma::mat& f_discretized) {
 
-    if (degree >= 14) {
-        matrix[14][0] = sqrt(8.58E2)*(-1.0/6.4E1);
-        matrix[14][2] = sqrt(8.58E2)*(7.0/6.4E1);
-        matrix[14][4] = sqrt(8.58E2)*(-7.0/6.4E1);
-        matrix[14][6] = sqrt(8.58E2)*(7.0/1.92E2);
-        matrix[14][8] = sqrt(8.58E2)*(-1.0/1.92E2);
-        matrix[14][10] = sqrt(8.58E2)*3.472222222222222E-4;
-        matrix[14][12] = sqrt(8.58E2)*(-1.052188552188552E-5);
-        matrix[14][14] = sqrt(8.58E2)*1.156251156251156E-7;
-    }
+    int n = gauss->nodes_1d.size();
+    int degree = conf->degree;
+    int n_rest = f_discretized.n_elem;
 
-    if (degree >= 15) {
-        matrix[15][1] = 3.781534080237807E1*(-3.0/6.4E1);
-        matrix[15][3] = 3.781534080237807E1*(7.0/6.4E1);
-        matrix[15][5] = 3.781534080237807E1*(-2.1E1/3.2E2);
-        matrix[15][7] = 3.781534080237807E1*(1.0/6.4E1);
-        matrix[15][9] = 3.781534080237807E1*(-1.0/5.76E2);
-        matrix[15][11] = 3.781534080237807E1*9.46969696969697E-5;
-        matrix[15][13] = 3.781534080237807E1*(-2.428127428127428E-6);
-        matrix[15][15] = 3.781534080237807E1*2.312502312502313E-8;
-    }
+    // Array to contract, with n_lower columns: f_discretized itself for the
+    // first dimension, read without copy, then the result of the previous one.
+    arma::mat contracted;
+    const double* source = f_discretized.memptr();
+    int n_lower = 1;
 
-    if (degree >= 16) {
-        matrix[16][0] = 3.781534080237807E1*(3.0/2.56E2);
-        matrix[16][2] = 3.781534080237807E1*(-3.0/3.2E1);
-        matrix[16][4] = 3.781534080237807E1*(7.0/6.4E1);
-        matrix[16][6] = 3.781534080237807E1*(-7.0/1.6E2);
-        matrix[16][8] = 3.781534080237807E1*(1.0/1.28E2);
-        matrix[16][10] = 3.781534080237807E1*(-6.944444444444444E-4);
-        matrix[16][12] = 3.781534080237807E1*3.156565656565657E-5;
-        matrix[16][14] = 3.781534080237807E1*(-6.937506937506938E-7);
-        matrix[16][16] = 3.781534080237807E1*5.781255781255781E-9;
-    }
+    for (int k = 0; k < nf; ++k) {
 
-    if (degree >= 17) {
-        matrix[17][1] = 1.559166443969341E2*(3.0/2.56E2);
-        matrix[17][3] = 1.559166443969341E2*(-1.0/3.2E1);
-        matrix[17][5] = 1.559166443969341E2*(7.0/3.2E2);
-        matrix[17][7] = 1.559166443969341E2*(-1.0/1.6E2);
-        matrix[17][9] = 1.559166443969341E2*8.680555555555556E-4;
-        matrix[17][11] = 1.559166443969341E2*(-6.313131313131313E-5);
-        matrix[17][13] = 1.559166443969341E2*2.428127428127428E-6;
-        matrix[17][15] = 1.559166443969341E2*(-4.625004625004625E-8);
-        matrix[17][17] = 1.559166443969341E2*3.400738694856342E-10;
-    }
+        n_rest /= n;
+        int n_upper = bin(degree + k + 1, k + 1);
+        arma::mat next(n_rest, n_upper);
 
-    if (degree >= 18) {
-        matrix[18][0] = 1.102497165529236E2*(-1.0/2.56E2);
-        matrix[18][2] = 1.102497165529236E2*(9.0/2.56E2);
-        matrix[18][4] = 1.102497165529236E2*(-3.0/6.4E1);
-        matrix[18][6] = 1.102497165529236E2*(7.0/3.2E2);
-        matrix[18][8] = 1.102497165529236E2*(-3.0/6.4E2);
-        matrix[18][10] = 1.102497165529236E2*5.208333333333333E-4;
-        matrix[18][12] = 1.102497165529236E2*(-3.156565656565657E-5);
-        matrix[18][14] = 1.102497165529236E2*1.040626040626041E-6;
-        matrix[18][16] = 1.102497165529236E2*(-1.734376734376734E-8);
-        matrix[18][18] = 1.102497165529236E2*1.133579564952114E-10;
-    }
+        for (int i = 0; i < n_lower; ++i) {
 
-    if (degree >= 19) {
-        matrix[19][1] = 4.805673730081975E2*(-1.0/2.56E2);
-        matrix[19][3] = 4.805673730081975E2*(3.0/2.56E2);
-        matrix[19][5] = 4.805673730081975E2*(-3.0/3.2E2);
-        matrix[19][7] = 4.805673730081975E2*(1.0/3.2E2);
-        matrix[19][9] = 4.805673730081975E2*(-5.208333333333333E-4);
-        matrix[19][11] = 4.805673730081975E2*4.734848484848485E-5;
-        matrix[19][13] = 4.805673730081975E2*(-2.428127428127428E-6);
-        matrix[19][15] = 4.805673730081975E2*6.937506937506938E-8;
-        matrix[19][17] = 4.805673730081975E2*(-1.020221608456903E-9);
-        matrix[19][19] = 4.805673730081975E2*5.966208236590074E-12;
-    }
+            // Contraction of the first remaining dimension
+            arma::mat column(const_cast<double*>(source) + (size_t) i*n*n_rest, n, n_rest, false, true);
+            arma::mat product = column.t() * hermite_nodes_1d;
 
-    if (degree >= 20) {
-        matrix[20][0] = 2.149162627629654E2*(1.0/5.12E2);
-        matrix[20][2] = 2.149162627629654E2*(-5.0/2.56E2);
-        matrix[20][4] = 2.149162627629654E2*(1.5E1/5.12E2);
-        matrix[20][6] = 2.149162627629654E2*(-1.0/6.4E1);
-        matrix[20][8] = 2.149162627629654E2*(1.0/2.56E2);
-        matrix[20][10] = 2.149162627629654E2*(-5.208333333333333E-4);
-        matrix[20][12] = 2.149162627629654E2*3.945707070707071E-5;
-        matrix[20][14] = 2.149162627629654E2*(-1.734376734376734E-6);
-        matrix[20][16] = 2.149162627629654E2*4.335941835941836E-8;
-        matrix[20][18] = 2.149162627629654E2*(-5.66789782476057E-10);
-        matrix[20][20] = 2.149162627629654E2*2.983104118295037E-12;
-    }
+            for (int m = 0; m <= degree; ++m) {
+                int index = extensions[k][i*(degree + 1) + m];
+                if (index >= 0)
+                    next.col(index) = product.col(m);
+            }
+        }
 
-    if (degree >= 21) {
-        matrix[21][1] = 9.848700421883082E2*(1.0/5.12E2);
-        matrix[21][3] = 9.848700421883082E2*(-5.0/7.68E2);
-        matrix[21][5] = 9.848700421883082E2*(3.0/5.12E2);
-        matrix[21][7] = 9.848700421883082E2*(-1.0/4.48E2);
-        matrix[21][9] = 9.848700421883082E2*4.340277777777778E-4;
-        matrix[21][11] = 9.848700421883082E2*(-4.734848484848485E-5);
-        matrix[21][13] = 9.848700421883082E2*3.035159285159285E-6;
-        matrix[21][15] = 9.848700421883082E2*(-1.156251156251156E-7);
-        matrix[21][17] = 9.848700421883082E2*2.550554021142256E-9;
-        matrix[21][19] = 9.848700421883082E2*(-2.983104118295037E-11);
-        matrix[21][21] = 9.848700421883082E2*1.420525770616684E-13;
+        contracted = next;
+        source = contracted.memptr();
+        n_lower = contracted.n_cols;
     }
 
-    if (degree >= 22) {
-        matrix[22][0] = 4.199499970234552E2*(-9.765625E-4);
-        matrix[22][2] = 4.199499970234552E2*1.07421875E-2;
-        matrix[22][4] = 4.199499970234552E2*(-1.790364583333333E-2);
-        matrix[22][6] = 4.199499970234552E2*1.07421875E-2;
-        matrix[22][8] = 4.199499970234552E2*(-3.069196428571429E-3);
-        matrix[22][10] = 4.199499970234552E2*4.774305555555556E-4;
-        matrix[22][12] = 4.199499970234552E2*(-4.340277777777778E-5);
-        matrix[22][14] = 4.199499970234552E2*2.38476800976801E-6;
-        matrix[22][16] = 4.199499970234552E2*(-7.949226699226699E-8);
-        matrix[22][18] = 4.199499970234552E2*1.558671901809157E-9;
-        matrix[22][20] = 4.199499970234552E2*(-1.64070726506227E-11);
-        matrix[22][22] = 4.199499970234552E2*7.102628853083421E-14;
-    }
+    return contracted.t();
+}
 
-    if (degree >= 23) {
-        matrix[23][1] = 2.014009433940169E3*(-9.765625E-4);
-        matrix[23][3] = 2.014009433940169E3*3.580729166666667E-3;
-        matrix[23][5] = 2.014009433940169E3*(-3.580729166666667E-3);
-        matrix[23][7] = 2.014009433940169E3*1.534598214285714E-3;
-        matrix[23][9] = 2.014009433940169E3*(-3.410218253968254E-4);
-        matrix[23][11] = 2.014009433940169E3*4.340277777777778E-5;
-        matrix[23][13] = 2.014009433940169E3*(-3.338675213675214E-6);
-        matrix[23][15] = 2.014009433940169E3*1.58984533984534E-7;
-        matrix[23][17] = 2.014009433940169E3*(-4.67601570542747E-9);
-        matrix[23][19] = 2.014009433940169E3*8.203536325311351E-11;
-        matrix[23][21] = 2.014009433940169E3*(-7.812891738391763E-13);
-        matrix[23][23] = 2.014009433940169E3*3.088099501340618E-15;
-    }
+/*! Sum-factorized evaluation of Hermite expansions at the nodes
+ *
+ * Equivalent to hermite_nodes * coefficients. The dimensions are expanded
+ * from the last to the first: the array stored has one column per
+ * multi-index of the dimensions not yet expanded, and each column contains
+ * the node indices of the expanded dimensions, followed by the function index.
+ */
+arma::mat Solver_spectral::tensor_evaluate (const arma::mat& coefficients) {
 
-    if (degree >= 24) {
-        matrix[24][0] = 8.222159083841665E2*4.8828125E-4;
-        matrix[24][2] = 8.222159083841665E2*(-3.0/5.12E2);
-        matrix[24][4] = 8.222159083841665E2*1.07421875E-2;
-        matrix[24][6] = 8.222159083841665E2*(-7.161458333333333E-3);
-        matrix[24][8] = 8.222159083841665E2*2.301897321428571E-3;
-        matrix[24][10] = 8.222159083841665E2*(-4.092261904761905E-4);
-        matrix[24][12] = 8.222159083841665E2*4.340277777777778E-5;
-        matrix[24][14] = 8.222159083841665E2*(-2.861721611721612E-6);
-        matrix[24][16] = 8.222159083841665E2*1.192384004884005E-7;
-        matrix[24][18] = 8.222159083841665E2*(-3.117343803618313E-9);
-        matrix[24][20] = 8.222159083841665E2*4.922121795186811E-11;
-        matrix[24][22] = 8.222159083841665E2*(-4.261577311850053E-13);
-        matrix[24][24] = 8.222159083841665E2*1.544049750670309E-15;
-    }
+    int n = gauss->nodes_1d.size();
+    int degree = conf->degree;
 
-    if (degree >= 25) {
-        matrix[25][1] = 8.222159083841665E2*2.44140625E-3;
-        matrix[25][3] = 8.222159083841665E2*(-5.0/5.12E2);
-        matrix[25][5] = 8.222159083841665E2*1.07421875E-2;
-        matrix[25][7] = 8.222159083841665E2*(-5.115327380952381E-3);
-        matrix[25][9] = 8.222159083841665E2*1.278831845238095E-3;
-        matrix[25][11] = 8.222159083841665E2*(-1.860119047619048E-4);
-        matrix[25][13] = 8.222159083841665E2*1.669337606837607E-5;
-        matrix[25][15] = 8.222159083841665E2*(-9.539072039072039E-7);
-        matrix[25][17] = 8.222159083841665E2*3.507011779070603E-8;
-        matrix[25][19] = 8.222159083841665E2*(-8.203536325311351E-10);
-        matrix[25][21] = 8.222159083841665E2*1.171933760758764E-11;
-        matrix[25][23] = 8.222159083841665E2*(-9.264298504021853E-14);
-        matrix[25][25] = 8.222159083841665E2*3.088099501340618E-16;
-    }
+    arma::mat expanded = coefficients.t();
 
-    if (degree >= 26) {
-        matrix[26][0] = 3.224996124028679E2*(-1.220703125E-3);
-        matrix[26][2] = 3.224996124028679E2*1.5869140625E-2;
-        matrix[26][4] = 3.224996124028679E2*(-3.173828125E-2);
-        matrix[26][6] = 3.224996124028679E2*2.327473958333333E-2;
-        matrix[26][8] = 3.224996124028679E2*(-8.312406994047619E-3);
-        matrix[26][10] = 3.224996124028679E2*1.662481398809524E-3;
-        matrix[26][12] = 3.224996124028679E2*(-2.015128968253968E-4);
-        matrix[26][14] = 3.224996124028679E2*1.550099206349206E-5;
-        matrix[26][16] = 3.224996124028679E2*(-7.750496031746032E-7);
-        matrix[26][18] = 3.224996124028679E2*2.53284184043988E-8;
-        matrix[26][20] = 3.224996124028679E2*(-5.332298611452378E-10);
-        matrix[26][22] = 3.224996124028679E2*6.925063131756335E-12;
-        matrix[26][24] = 3.224996124028679E2*(-5.018161689678504E-14);
-        matrix[26][26] = 3.224996124028679E2*1.544049750670309E-16;
-    }
+    for (int k = nf - 1; k >= 0; --k) {
 
-    if (degree >= 27) {
-        matrix[27][1] = 5.585857141030372E2*(-3.662109375E-3);
-        matrix[27][3] = 5.585857141030372E2*1.5869140625E-2;
-        matrix[27][5] = 5.585857141030372E2*(-1.904296875E-2);
-        matrix[27][7] = 5.585857141030372E2*9.974888392857143E-3;
-        matrix[27][9] = 5.585857141030372E2*(-2.770802331349206E-3);
-        matrix[27][11] = 5.585857141030372E2*4.534040178571429E-4;
-        matrix[27][13] = 5.585857141030372E2*(-4.650297619047619E-5);
-        matrix[27][15] = 5.585857141030372E2*3.100198412698413E-6;
-        matrix[27][17] = 5.585857141030372E2*(-1.367734593837535E-7);
-        matrix[27][19] = 5.585857141030372E2*3.999223958589284E-9;
-        matrix[27][21] = 5.585857141030372E2*(-7.617569444931969E-11);
-        matrix[27][23] = 5.585857141030372E2*9.032691041421307E-13;
-        matrix[27][25] = 5.585857141030372E2*(-6.021794027614205E-15);
-        matrix[27][27] = 5.585857141030372E2*1.715610834078121E-17;
-    }
+        int n_rest = expanded.n_rows;
+        int n_lower = bin(degree + k, k);
+        arma::mat next(n * n_rest, n_lower);
+        arma::mat gathered(n_rest, degree + 1);
 
-    if (degree >= 28) {
-        matrix[28][0] = 2.111255550614373E2*1.8310546875E-3;
-        matrix[28][2] = 2.111255550614373E2*(-2.5634765625E-2);
-        matrix[28][4] = 2.111255550614373E2*5.55419921875E-2;
-        matrix[28][6] = 2.111255550614373E2*(-4.443359375E-2);
-        matrix[28][8] = 2.111255550614373E2*1.74560546875E-2;
-        matrix[28][10] = 2.111255550614373E2*(-3.879123263888889E-3);
-        matrix[28][12] = 2.111255550614373E2*5.289713541666667E-4;
-        matrix[28][14] = 2.111255550614373E2*(-4.650297619047619E-5);
-        matrix[28][16] = 2.111255550614373E2*2.712673611111111E-6;
-        matrix[28][18] = 2.111255550614373E2*(-1.063793572984749E-7);
-        matrix[28][20] = 2.111255550614373E2*2.799456771012499E-9;
-        matrix[28][22] = 2.111255550614373E2*(-4.847544192229435E-11);
-        matrix[28][24] = 2.111255550614373E2*5.269069774162429E-13;
-        matrix[28][26] = 2.111255550614373E2*(-3.242504476407649E-15);
-        matrix[28][28] = 2.111255550614373E2*8.578054170390605E-18;
-    }
+        for (int i = 0; i < n_lower; ++i) {
 
-    if (degree >= 29) {
-        matrix[29][1] = 1.13694590900359E3*1.8310546875E-3;
-        matrix[29][3] = 1.13694590900359E3*(-8.544921875E-3);
-        matrix[29][5] = 1.13694590900359E3*1.11083984375E-2;
-        matrix[29][7] = 1.13694590900359E3*(-6.34765625E-3);
-        matrix[29][9] = 1.13694590900359E3*1.939561631944444E-3;
-        matrix[29][11] = 1.13694590900359E3*(-3.526475694444444E-4);
-        matrix[29][13] = 1.13694590900359E3*4.069010416666667E-5;
-        matrix[29][15] = 1.13694590900359E3*(-3.100198412698413E-6);
-        matrix[29][17] = 1.13694590900359E3*1.595690359477124E-7;
-        matrix[29][19] = 1.13694590900359E3*(-5.598913542024997E-9);
-        matrix[29][21] = 1.13694590900359E3*1.333074652863095E-10;
-        matrix[29][23] = 1.13694590900359E3*(-2.107627909664972E-12);
-        matrix[29][25] = 1.13694590900359E3*2.107627909664972E-14;
-        matrix[29][27] = 1.13694590900359E3*(-1.200927583854685E-16);
-        matrix[29][29] = 1.13694590900359E3*2.957949713927795E-19;
-    }
+            gathered.zeros();
+            for (int m = 0; m <= degree; ++m) {
+                int index = extensions[k][i*(degree + 1) + m];
+                if (index < 0) break;
+                gathered.col(m) = expanded.col(index);
+            }
+
+            // Expansion in the dimension k
+            arma::mat column(next.colptr(i), n, n_rest, false, true);
+            column = hermite_nodes_1d * gathered.t();
+        }
 
-    if (degree >= 30) {
-        matrix[30][0] = 1.037884868374137E3*(-3.662109375E-4);
-        matrix[30][2] = 1.037884868374137E3*5.4931640625E-3;
-        matrix[30][4] = 1.037884868374137E3*(-1.28173828125E-2);
-        matrix[30][6] = 1.037884868374137E3*1.11083984375E-2;
-        matrix[30][8] = 1.037884868374137E3*(-4.7607421875E-3);
-        matrix[30][10] = 1.037884868374137E3*1.163736979166667E-3;
-        matrix[30][12] = 1.037884868374137E3*(-1.763237847222222E-4);
-        matrix[30][14] = 1.037884868374137E3*1.743861607142857E-5;
-        matrix[30][16] = 1.037884868374137E3*(-1.162574404761905E-6);
-        matrix[30][18] = 1.037884868374137E3*5.318967864923747E-8;
-        matrix[30][20] = 1.037884868374137E3*(-1.679674062607499E-9);
-        matrix[30][22] = 1.037884868374137E3*3.635658144172076E-11;
-        matrix[30][24] = 1.037884868374137E3*(-5.269069774162429E-13);
-        matrix[30][26] = 1.037884868374137E3*4.863756714611473E-15;
-        matrix[30][28] = 1.037884868374137E3*(-2.573416251117181E-17);
-        matrix[30][30] = 1.037884868374137E3*5.91589942785559E-20;
+        expanded = next;
     }
 
+    return arma::reshape(expanded, gauss->weights.size(), coefficients.n_cols);
+}
 
-    if (degree >= 31) {
-        matrix[31][1] = 5.778698382854049E3*(-3.662109375E-4);
-        matrix[31][3] = 5.778698382854049E3*1.8310546875E-3;
-        matrix[31][5] = 5.778698382854049E3*(-2.5634765625E-3);
-        matrix[31][7] = 5.778698382854049E3*1.5869140625E-3;
-        matrix[31][9] = 5.778698382854049E3*(-5.289713541666667E-4);
-        matrix[31][11] = 5.778698382854049E3*1.057942708333333E-4;
-        matrix[31][13] = 5.778698382854049E3*(-1.356336805555556E-5);
-        matrix[31][15] = 5.778698382854049E3*1.162574404761905E-6;
-        matrix[31][17] = 5.778698382854049E3*(-6.838672969187675E-8);
-        matrix[31][19] = 5.778698382854049E3*2.799456771012499E-9;
-        matrix[31][21] = 5.778698382854049E3*(-7.998447917178567E-11);
-        matrix[31][23] = 5.778698382854049E3*1.580720932248729E-12;
-        matrix[31][25] = 5.778698382854049E3*(-2.107627909664972E-14);
-        matrix[31][27] = 5.778698382854049E3*1.801391375782027E-16;
-        matrix[31][29] = 5.778698382854049E3*(-8.873849141783384E-19);
-        matrix[31][31] = 5.778698382854049E3*1.908354654146964E-21;
-    }
+/*! Sum-factorized assembly of the Galerkin matrix
+ *
+ * Equivalent to hermite_nodes.t() * diagmat(diff_discretized) * hermite_nodes.
+ * The contraction proceeds as in tensor_project, but on pairs of
+ * multi-indices, and against products of unidimensional polynomials.
+ */
+arma::mat Solver_spectral::tensor_matrix (const arma::vec& diff_discretized) {
 
-    if (degree >= 32) {
-        matrix[32][0] = 8.172313625895668E3*4.57763671875E-5;
-        matrix[32][2] = 8.172313625895668E3*(-7.32421875E-4);
-        matrix[32][4] = 8.172313625895668E3*1.8310546875E-3;
-        matrix[32][6] = 8.172313625895668E3*(-1.708984375E-3);
-        matrix[32][8] = 8.172313625895668E3*7.9345703125E-4;
-        matrix[32][10] = 8.172313625895668E3*(-2.115885416666667E-4);
-        matrix[32][12] = 8.172313625895668E3*3.526475694444444E-5;
-        matrix[32][14] = 8.172313625895668E3*(-3.875248015873016E-6);
-        matrix[32][16] = 8.172313625895668E3*2.906436011904762E-7;
-        matrix[32][18] = 8.172313625895668E3*(-1.519705104263928E-8);
-        matrix[32][20] = 8.172313625895668E3*5.598913542024997E-10;
-        matrix[32][22] = 8.172313625895668E3*(-1.45426325766883E-11);
-        matrix[32][24] = 8.172313625895668E3*2.634534887081215E-13;
-        matrix[32][26] = 8.172313625895668E3*(-3.242504476407649E-15);
-        matrix[32][28] = 8.172313625895668E3*2.573416251117181E-17;
-        matrix[32][30] = 8.172313625895668E3*(-1.183179885571118E-19);
-        matrix[32][32] = 8.172313625895668E3*2.385443317683705E-22;
-    }
+    int n = gauss->nodes_1d.size();
+    int degree = conf->degree;
+    int n_rest = diff_discretized.n_elem;
 
-    if (degree >= 33) {
-        matrix[33][1] = 4.694636759111401E4*4.57763671875E-5;
-        matrix[33][3] = 4.694636759111401E4*(-2.44140625E-4);
-        matrix[33][5] = 4.694636759111401E4*3.662109375E-4;
-        matrix[33][7] = 4.694636759111401E4*(-2.44140625E-4);
-        matrix[33][9] = 4.694636759111401E4*8.816189236111111E-5;
-        matrix[33][11] = 4.694636759111401E4*(-1.923532196969697E-5);
-        matrix[33][13] = 4.694636759111401E4*2.712673611111111E-6;
-        matrix[33][15] = 4.694636759111401E4*(-2.583498677248677E-7);
-        matrix[33][17] = 4.694636759111401E4*1.709668242296919E-8;
-        matrix[33][19] = 4.694636759111401E4*(-7.998447917178567E-10);
-        matrix[33][21] = 4.694636759111401E4*2.666149305726189E-11;
-        matrix[33][23] = 4.694636759111401E4*(-6.322883728994915E-13);
-        matrix[33][25] = 4.694636759111401E4*1.053813954832486E-14;
-        matrix[33][27] = 4.694636759111401E4*(-1.200927583854685E-16);
-        matrix[33][29] = 4.694636759111401E4*8.873849141783384E-19;
-        matrix[33][31] = 4.694636759111401E4*(-3.816709308293929E-21);
-        matrix[33][33] = 4.694636759111401E4*7.228616114193047E-24;
+    // Products of unidimensional polynomials at the unidimensional nodes
+    arma::mat products(n, (degree + 1)*(degree + 1));
+    for (int i = 0; i <= degree; ++i) {
+        for (int j = 0; j <= degree; ++j) {
+            products.col(i*(degree + 1) + j) = hermite_nodes_1d.col(i) % hermite_nodes_1d.col(j);
+        }
     }
 
-    if (degree >= 34) {
-        matrix[34][0] = 8.051235619456184E3*(-4.57763671875E-5);
-        matrix[34][2] = 8.051235619456184E3*7.781982421875E-4;
-        matrix[34][4] = 8.051235619456184E3*(-2.0751953125E-3);
-        matrix[34][6] = 8.051235619456184E3*2.0751953125E-3;
-        matrix[34][8] = 8.051235619456184E3*(-1.03759765625E-3);
-        matrix[34][10] = 8.051235619456184E3*2.997504340277778E-4;
-        matrix[34][12] = 8.051235619456184E3*(-5.450007891414141E-5);
-        matrix[34][14] = 8.051235619456184E3*6.587921626984127E-6;
-        matrix[34][16] = 8.051235619456184E3*(-5.489934689153439E-7);
-        matrix[34][18] = 8.051235619456184E3*3.229373346560847E-8;
-        matrix[34][20] = 8.051235619456184E3*(-1.359736145920356E-9);
-        matrix[34][22] = 8.051235619456184E3*4.12041256339502E-11;
-        matrix[34][24] = 8.051235619456184E3*(-8.957418616076129E-13);
-        matrix[34][26] = 8.051235619456184E3*1.378064402473251E-14;
-        matrix[34][28] = 8.051235619456184E3*(-1.458269208966403E-16);
-        matrix[34][30] = 8.051235619456184E3*1.00570290273545E-18;
-        matrix[34][32] = 8.051235619456184E3*(-4.055253640062299E-21);
-        matrix[34][34] = 8.051235619456184E3*7.228616114193047E-24;
-    }
+    arma::mat contracted = diff_discretized;
+    int n_lower = 1;
 
-    if (degree >= 35) {
-        matrix[35][1] = 9.526350455447249E3*(-2.288818359375E-4);
-        matrix[35][3] = 9.526350455447249E3*1.2969970703125E-3;
-        matrix[35][5] = 9.526350455447249E3*(-2.0751953125E-3);
-        matrix[35][7] = 9.526350455447249E3*1.482282366071429E-3;
-        matrix[35][9] = 9.526350455447249E3*(-5.764431423611111E-4);
-        matrix[35][11] = 9.526350455447249E3*1.362501972853535E-4;
-        matrix[35][13] = 9.526350455447249E3*(-2.096156881313131E-5);
-        matrix[35][15] = 9.526350455447249E3*2.195973875661376E-6;
-        matrix[35][17] = 9.526350455447249E3*(-1.614686673280423E-7);
-        matrix[35][19] = 9.526350455447249E3*8.498350912002228E-9;
-        matrix[35][21] = 9.526350455447249E3*(-3.237467014096087E-10);
-        matrix[35][23] = 9.526350455447249E3*8.957418616076129E-12;
-        matrix[35][25] = 9.526350455447249E3*(-1.791483723215226E-13);
-        matrix[35][27] = 9.526350455447249E3*2.551971115691205E-15;
-        matrix[35][29] = 9.526350455447249E3*(-2.514257256838626E-17);
-        matrix[35][31] = 9.526350455447249E3*1.62210145602492E-19;
-        matrix[35][33] = 9.526350455447249E3*(-6.14432369706409E-22);
-        matrix[35][35] = 9.526350455447249E3*1.032659444884721E-24;
-    }
+    for (int k = 0; k < nf; ++k) {
 
-    if (degree >= 36) {
-        matrix[36][0] = 9.526350455447249E3*3.814697265625E-5;
-        matrix[36][2] = 9.526350455447249E3*(-6.866455078125E-4);
-        matrix[36][4] = 9.526350455447249E3*1.94549560546875E-3;
-        matrix[36][6] = 9.526350455447249E3*(-2.0751953125E-3);
-        matrix[36][8] = 9.526350455447249E3*1.111711774553571E-3;
-        matrix[36][10] = 9.526350455447249E3*(-3.458658854166667E-4);
-        matrix[36][12] = 9.526350455447249E3*6.812509864267677E-5;
-        matrix[36][14] = 9.526350455447249E3*(-8.983529491341991E-6);
-        matrix[36][16] = 9.526350455447249E3*8.234902033730159E-7;
-        matrix[36][18] = 9.526350455447249E3*(-5.382288910934744E-8);
-        matrix[36][20] = 9.526350455447249E3*2.549505273600668E-9;
-        matrix[36][22] = 9.526350455447249E3*(-8.829455492989328E-11);
-        matrix[36][24] = 9.526350455447249E3*2.239354654019032E-12;
-        matrix[36][26] = 9.526350455447249E3*(-4.134193207419752E-14);
-        matrix[36][28] = 9.526350455447249E3*5.468509533624011E-16;
-        matrix[36][30] = 9.526350455447249E3*(-5.028514513677251E-18);
-        matrix[36][32] = 9.526350455447249E3*3.041440230046724E-20;
-        matrix[36][34] = 9.526350455447249E3*(-1.084292417128957E-22);
-        matrix[36][36] = 9.526350455447249E3*1.721099074807868E-25;
-    }
+        n_rest /= n;
+        int n_upper = bin(degree + k + 1, k + 1);
+        arma::mat next = arma::zeros<arma::mat>(n_rest, n_upper * n_upper);
 
-    if (degree >= 37) {
-        matrix[37][1] = 5.79465276008839E4*3.814697265625E-5;
-        matrix[37][3] = 5.79465276008839E4*(-2.288818359375E-4);
-        matrix[37][5] = 5.79465276008839E4*3.8909912109375E-4;
-        matrix[37][7] = 5.79465276008839E4*(-2.964564732142857E-4);
-        matrix[37][9] = 5.79465276008839E4*1.235235305059524E-4;
-        matrix[37][11] = 5.79465276008839E4*(-3.144235321969697E-5);
-        matrix[37][13] = 5.79465276008839E4*5.240392203282828E-6;
-        matrix[37][15] = 5.79465276008839E4*(-5.989019660894661E-7);
-        matrix[37][17] = 5.79465276008839E4*4.84406001984127E-8;
-        matrix[37][19] = 5.79465276008839E4*(-2.832783637334076E-9);
-        matrix[37][21] = 5.79465276008839E4*1.214050130286033E-10;
-        matrix[37][23] = 5.79465276008839E4*(-3.838893692604055E-12);
-        matrix[37][25] = 5.79465276008839E4*8.957418616076129E-14;
-        matrix[37][27] = 5.79465276008839E4*(-1.531182669414723E-15);
-        matrix[37][29] = 5.79465276008839E4*1.885692942628969E-17;
-        matrix[37][31] = 5.79465276008839E4*(-1.62210145602492E-19);
-        matrix[37][33] = 5.79465276008839E4*9.216485545596135E-22;
-        matrix[37][35] = 5.79465276008839E4*(-3.097978334654163E-24);
-        matrix[37][37] = 5.79465276008839E4*4.651619121102347E-27;
-    }
+        for (int i1 = 0; i1 < n_lower; ++i1) {
+            for (int i2 = 0; i2 < n_lower; ++i2) {
 
-    if (degree >= 38) {
-        matrix[38][0] = 1.880033611401669E4*(-1.9073486328125E-5);
-        matrix[38][2] = 1.880033611401669E4*3.62396240234375E-4;
-        matrix[38][4] = 1.880033611401669E4*(-1.087188720703125E-3);
-        matrix[38][6] = 1.880033611401669E4*1.232147216796875E-3;
-        matrix[38][8] = 1.880033611401669E4*(-7.040841238839286E-4);
-        matrix[38][10] = 1.880033611401669E4*2.346947079613095E-4;
-        matrix[38][12] = 1.880033611401669E4*(-4.978372593118687E-5);
-        matrix[38][14] = 1.880033611401669E4*7.11196084731241E-6;
-        matrix[38][16] = 1.880033611401669E4*(-7.11196084731241E-7);
-        matrix[38][18] = 1.880033611401669E4*5.113174465388007E-8;
-        matrix[38][20] = 1.880033611401669E4*(-2.691144455467372E-9);
-        matrix[38][22] = 1.880033611401669E4*1.048497839792483E-10;
-        matrix[38][24] = 1.880033611401669E4*(-3.039124173311544E-12);
-        matrix[38][26] = 1.880033611401669E4*6.545805911747941E-14;
-        matrix[38][28] = 1.880033611401669E4*(-1.039016811388562E-15);
-        matrix[38][30] = 1.880033611401669E4*1.194272196998347E-17;
-        matrix[38][32] = 1.880033611401669E4*(-9.631227395147961E-20);
-        matrix[38][34] = 1.880033611401669E4*5.150388981362546E-22;
-        matrix[38][36] = 1.880033611401669E4*(-1.635044121067475E-24);
-        matrix[38][38] = 1.880033611401669E4*2.325809560551173E-27;
-    }
+                // Contraction of the first remaining dimension
+                arma::mat column(contracted.colptr(i1*n_lower + i2), n, n_rest, false, true);
+                arma::mat product = column.t() * products;
 
-    if (degree >= 39) {
-        matrix[39][1] = 3.913602046708377E4*(-5.7220458984375E-5);
-        matrix[39][3] = 3.913602046708377E4*3.62396240234375E-4;
-        matrix[39][5] = 3.913602046708377E4*(-6.52313232421875E-4);
-        matrix[39][7] = 3.913602046708377E4*5.280630929129464E-4;
-        matrix[39][9] = 3.913602046708377E4*(-2.346947079613095E-4);
-        matrix[39][11] = 3.913602046708377E4*6.400764762581169E-5;
-        matrix[39][13] = 3.913602046708377E4*(-1.14885521379662E-5);
-        matrix[39][15] = 3.913602046708377E4*1.422392169462482E-6;
-        matrix[39][17] = 3.913602046708377E4*(-1.255051914231602E-7);
-        matrix[39][19] = 3.913602046708377E4*8.073433366402116E-9;
-        matrix[39][21] = 3.913602046708377E4*(-3.844492079239103E-10);
-        matrix[39][23] = 3.913602046708377E4*1.367605877990195E-11;
-        matrix[39][25] = 3.913602046708377E4*(-3.646949007973853E-13);
-        matrix[39][27] = 3.913602046708377E4*7.273117679719934E-15;
-        matrix[39][29] = 3.913602046708377E4*(-1.074844977298512E-16);
-        matrix[39][31] = 3.913602046708377E4*1.155747287417755E-18;
-        matrix[39][33] = 3.913602046708377E4*(-8.755661268316328E-21);
-        matrix[39][35] = 3.913602046708377E4*4.414619126882182E-23;
-        matrix[39][37] = 3.913602046708377E4*(-1.325711449514169E-25);
-        matrix[39][39] = 3.913602046708377E4*1.789084277347056E-28;
-    }
+                for (int m1 = 0; m1 <= degree; ++m1) {
+                    int index1 = extensions[k][i1*(degree + 1) + m1];
+                    if (index1 < 0) break;
+                    for (int m2 = 0; m2 <= degree; ++m2) {
+                        int index2 = extensions[k][i2*(degree + 1) + m2];
+                        if (index2 < 0) break;
+                        next.col(index1*n_upper + index2) = product.col(m1*(degree + 1) + m2);
+                    }
+                }
+            }
+        }
 
-    if (degree >= 40) {
-        matrix[40][0] = 6.187948161547574E4*5.7220458984375E-6;
-        matrix[40][2] = 6.187948161547574E4*(-1.1444091796875E-4);
-        matrix[40][4] = 6.187948161547574E4*3.62396240234375E-4;
-        matrix[40][6] = 6.187948161547574E4*(-4.3487548828125E-4);
-        matrix[40][8] = 6.187948161547574E4*2.640315464564732E-4;
-        matrix[40][10] = 6.187948161547574E4*(-9.387788318452381E-5);
-        matrix[40][12] = 6.187948161547574E4*2.133588254193723E-5;
-        matrix[40][14] = 6.187948161547574E4*(-3.282443467990343E-6);
-        matrix[40][16] = 6.187948161547574E4*3.555980423656205E-7;
-        matrix[40][18] = 6.187948161547574E4*(-2.789004253848004E-8);
-        matrix[40][20] = 6.187948161547574E4*1.614686673280423E-9;
-        matrix[40][22] = 6.187948161547574E4*(-6.989985598616551E-11);
-        matrix[40][24] = 6.187948161547574E4*2.279343129983658E-12;
-        matrix[40][26] = 6.187948161547574E4*(-5.610690781498235E-14);
-        matrix[40][28] = 6.187948161547574E4*1.039016811388562E-15;
-        matrix[40][30] = 6.187948161547574E4*(-1.433126636398017E-17);
-        matrix[40][32] = 6.187948161547574E4*1.444684109272194E-19;
-        matrix[40][34] = 6.187948161547574E4*(-1.030077796272509E-21);
-        matrix[40][36] = 6.187948161547574E4*4.905132363202425E-24;
-        matrix[40][38] = 6.187948161547574E4*(-1.395485736330704E-26);
-        matrix[40][40] = 6.187948161547574E4*1.789084277347056E-29;
+        contracted = next;
+        n_lower = n_upper;
     }
 
-    if (degree > 40) {
-        cout << "Degree too high" << endl; exit(0);
+    return arma::reshape(contracted, n_lower, n_lower);
+}
+
+/*! Function to compute hermite coefficients
+ *
+ * This fills the matrix passed in argument with the coefficients of the
+ * orthonormal Hermite polynomials of degree 0 to the degree passed to the
+ * method: line n contains the coefficients of h_n in terms of the monomials.
+ * They are obtained from the three-term recurrence
+ * h_{n+1}(x) = (x h_n(x) - sqrt(n) h_{n-1}(x))/sqrt(n+1), for any degree.
+ */
+void Solver_spectral::hermite_coefficients (int degree, mat& matrix) {
+
+    if (degree >= 0)
+        matrix[0][0] = 1.;
+
+    if (degree >= 1)
+        matrix[1][1] = 1.;
+
+    for (int n = 1; n < degree; ++n) {
+        for (int j = 0; j <= n + 1; ++j) {
+            double shifted = (j > 0) ? matrix[n][j-1] : 0.;
+            matrix[n+1][j] = (shifted - sqrt(n)*matrix[n-1][j])/sqrt(n+1);
+        }
     }
 }
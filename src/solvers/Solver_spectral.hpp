@@ -5,7 +5,6 @@
 #include <string>
 #include <functional>
 #include <vector>
-#include <unordered_map>
 #include <armadillo>
 
 #include "global/global.hpp"
@@ -13,11 +12,47 @@
 #include "toolbox/Gaussian_integrator.hpp"
 #include "problems/Problem.hpp"
 #include "solvers/Analyser.hpp"
+#include "toolbox/linear_algebra.hpp"
+#include "toolbox/combinatorics.hpp"
 
 struct config_spectral {
     int n_nodes;
     int degree;
     std::vec scaling;
+
+    // Relative weight below which the nodes of the tensor grid are dropped,
+    // see Gaussian_integrator. Pruned grids don't allow sum factorization,
+    // so they are only used when it is disabled.
+    double prune = 0.;
+
+    // Evaluate the Hermite polynomials directly at the quadrature nodes (1),
+    // or go through their expansion in monomials (0).
+    int vandermonde = 1;
+
+    // Solve the linear systems for all degrees with a single Cholesky
+    // factorization of the largest Galerkin matrix (1), or with one dense
+    // solve per degree and per right-hand side (0).
+    int cholesky = 1;
+
+    // On tensor grids (n_nodes > 0), apply the projections and assemble the
+    // Galerkin matrix dimension by dimension (sum factorization).
+    int sum_factorization = 1;
+
+    // Solve the linear systems without assembling the Galerkin matrix, with a
+    // preconditioned conjugate gradient method applied to all the right-hand
+    // sides at once, iterating until the relative residual is below cg_tolerance.
+    int matrix_free = 0;
+    double cg_tolerance = 1e-12;
+    int cg_max_iterations = 1000;
+
+    // When the linear term of the problem is a polynomial in y, compute the
+    // Galerkin matrix exactly in sparse storage instead of by quadrature.
+    int exact_polynomial = 1;
+
+    // Number of threads of the loops over the nodes and over the basis, or 0
+    // for the default of OpenMP. The results don't depend on it. The dense
+    // factorizations use the threads of the BLAS/LAPACK library.
+    int n_threads = 0;
 };
 
 class Solver_spectral : public Solver {
@@ -26,62 +61,114 @@ class Solver_spectral : public Solver {
         Solver_spectral(Problem*, Analyser*, config_spectral*);
         SDE_coeffs estimator(std::vec x, double t);
         std::vector<SDE_coeffs> full_estimator(std::vec x, double t, std::vector<int> degrees);
+        std::vector<SDE_coeffs> estimator_batch(const std::vector<std::vec>& xs, double t);
 
     private:
 
         config_spectral* conf;
 
-        struct Hash_multi_index {
-
-            // "Hashing" function for multi_indices. Associate a unique integer to
-            // any multi-index with |m|_inf < base.
-            size_t operator() (const std::vector<int>& multi_index) const {
-
-                // The base, which limits the validity of the hash function.
-                int base = 100;
-
-                int tmp = 0;
-                for (unsigned int i = 0; i < multi_index.size(); ++i) {
-                    tmp += multi_index[i] * pow(base, i);
-                }
-
-                return std::hash<int>()(tmp);
-            }
-        };
-
-        // Cached multi-indices
-        std::vector< std::vector<int> > ind2mult;
-        std::unordered_map<std::vector<int>, int, Hash_multi_index> mult2ind;
+        // Multi-indices of degree at most twice the degree of the basis, which
+        // are also ranked by ind2mult.rank.
+        Multi_indices ind2mult;
 
         // Number of dimension to solve on
         int nf;
         int ns;
 
-        // Matrix containing the coefficients of uni- and multi- dimensional Hermite polynomials in terms of monomials.
+        // Matrix containing the coefficients of unidimensional Hermite polynomials in terms of monomials.
         std::mat hermiteCoeffs_1d;
-        std::mat hermiteCoeffs_nd;
 
-        double gaussian_linear_term(std::vec z);
-        std::vec map_to_real(std::vec z);
+        // Values of the multi-dimensional Hermite polynomials at the quadrature nodes.
+        arma::mat hermite_nodes;
+
+        // For sum factorization on tensor grids: values of the unidimensional
+        // Hermite polynomials at the unidimensional nodes, and, for each
+        // dimension k, the index of the multi-index (m_0, ..., m_k) in the list
+        // of k+1 dimensional multi-indices, at position (index of
+        // (m_0, ..., m_{k-1}))*(degree + 1) + m_k, or -1 if its degree is too high.
+        bool tensor;
+        arma::mat hermite_nodes_1d;
+        std::vector< std::vector<int> > extensions;
+
+        double gaussian_linear_term(const double* z);
 
         // Calculate coefficients of Hermite polynomials.
         void hermite_coefficients (int degree, std::mat& matrix);
 
+        // Evaluate Hermite polynomials at the quadrature nodes.
+        void hermite_values (int degree, double z, std::vec& values);
+        void hermite_vandermonde (int degree, arma::mat& values);
+
+        // Sum-factorized kernels for tensor grids
+        void tensor_tables (int degree);
+        arma::mat tensor_project (const arma::mat& f_discretized);
+        arma::mat tensor_evaluate (const arma::mat& coefficients);
+        arma::mat tensor_matrix (const arma::vec& diff_discretized);
+
         // Update variance and bias of gaussian
-        void update_stats();
+        void update_stats(const analyser_stats& stats);
 
         // Compute matrix of the linear system
-        std::mat compute_matrix(std::vec x);
+        arma::mat compute_matrix(std::vec x);
+
+        // Assemble and factorize the matrix of the linear system
+        void factorize(std::vec x);
+        void update_factorization(std::vec x);
+
+        // Solve the linear system for several right-hand sides
+        arma::mat solve(const arma::mat& rhs, const arma::mat& guess);
+
+        // Value of x at which the matrix was last factorized, matrix of the
+        // linear system, kept only when the Cholesky factorization is not
+        // used, and its Cholesky factor. Since the basis is ordered by
+        // degree, the leading blocks of the factor are the factors of the
+        // matrices of lower degrees.
+        std::vec factorization_x;
+        arma::mat matrix;
+        arma::mat factor;
+        bool factorized;
+
+        // Exact factor in sparse storage, for polynomial linear terms
+        skyline sparse_factor;
+        bool sparse;
+
+        // Discretized potential, for the matrix-free solver
+        arma::vec diff_discretized;
+
+        // Exact matrix of the linear system for polynomial linear terms
+        skyline polynomial_matrix(std::vec x);
+
+        // Diagonal part of the operator, and discretized potential part
+        arma::vec diagonal_term();
+        std::vec discretize_linear_terms(std::vec x);
+
+        // Matrix-free application of the operator, and conjugate gradient solver
+        arma::mat apply_operator(const arma::vec& diff_discretized, const arma::mat& coefficients);
+        arma::mat conjugate_gradient(const arma::vec& diff_discretized, const arma::mat& rhs, arma::mat solution);
 
         // Compute effective coefficients from expansions in Hermite functions
-        SDE_coeffs compute_averages(const std::mat& functions, const std::mat& solutions);
+        SDE_coeffs compute_averages(const arma::mat& functions_herm, const arma::mat& solutions_herm);
 
-        // Discretize function on grid
-        std::vec discretize(std::vec x, double(*f)(std::vec,std::vec));
+        // Discretize functions on grid, one per column
+        arma::mat discretize(std::vec x, const std::vector<void (*) (const double*, const double*, size_t, double*)>& functions);
+        arma::mat discretize_functions(std::vec x);
 
         // Project discretized functions on monomials and hermite polynomials
         std::vec project_mon(int nf, int degree, std::vec f_discretized, int rescale);
         std::vec project_herm(int nf, int degree, std::vec f_discretized, int rescale);
+        arma::mat project_herm(const arma::mat& f_discretized);
+        arma::mat mon_to_herm(const arma::mat& coefficients);
+
+        // Products with the matrix of values of Hermite polynomials at the
+        // nodes, and with its transpose.
+        arma::mat herm_to_nodes(const arma::mat& coefficients);
+        arma::mat nodes_to_herm(const arma::mat& f_nodes);
+        void hermite_node(int i, arma::vec& values, std::vector<double>& work);
+
+        // Values of the basis at a point, specialized for dimensions known at
+        // compile time (NF > 0) and dispatched on nf.
+        template<int NF> void hermite_point_nf(int degree, const double* z, int nb, double* values, size_t stride, double* work);
+        void hermite_point(int degree, const double* z, int nb, double* values, size_t stride, double* work);
 
         // Statistics associated with the hermite functions
         std::vec bias;
@@ -90,8 +177,11 @@ class Solver_spectral : public Solver {
         std::mat sqrt_cov;
         double det_cov;
 
+        // Normalization of the invariant density
+        double normalization;
+
         // Integrator
-        Gaussian_integrator *gauss;
+        std::shared_ptr<const Gaussian_integrator> gauss;
         Problem *problem;
         Analyser *analyser;
 };
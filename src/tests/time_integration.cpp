@@ -4,12 +4,17 @@ using namespace std;
 
 namespace tests {
 
-    void integrate(Problem *problem, Solver *solver, int seed, vec& time, mat& solution) {
+    // Integrate an ensemble of paths, one per seed, estimating the coefficients
+    // for all the paths with a single call to the solver at each time step.
+    void integrate(Problem *problem, Solver *solver, vector<int> seeds, vec& time, cube& solutions) {
 
         // Macro time-step
         double Dt = .01;
         int nSteps = 100;
 
+        // Number of paths
+        int nPaths = seeds.size();
+
         // Create vector of times
         vec t(nSteps + 1,0.);
         for (int i = 0; i < nSteps + 1; i++)
@@ -17,46 +22,64 @@ namespace tests {
             t[i] = i*Dt;
         }
 
-        // Create brownian motion
-        mat dWs(nSteps + 1,vec(problem->ns, 0.));
-        default_random_engine generator; generator.seed(seed);
-        normal_distribution<double> distribution(0.0,1.0);
-
-        for (int i = 0; i < nSteps; i++)
+        // Create brownian motions
+        cube dWs(nPaths, mat(nSteps + 1,vec(problem->ns, 0.)));
+        for (int p = 0; p < nPaths; p++)
         {
-            for (int j = 0; j < problem->ns ; j++)
+            default_random_engine generator; generator.seed(seeds[p]);
+            normal_distribution<double> distribution(0.0,1.0);
+
+            for (int i = 0; i < nSteps; i++)
             {
-                dWs[i][j] = distribution(generator);
+                for (int j = 0; j < problem->ns ; j++)
+                {
+                    dWs[p][i][j] = distribution(generator);
+                }
             }
         }
 
-        // Calculate approximate solution
-        mat x(nSteps + 1, vec(problem->ns,0.));
-        x[0] = problem->x0;
+        // Calculate approximate solutions
+        cube x(nPaths, mat(nSteps + 1, vec(problem->ns,0.)));
+        for (int p = 0; p < nPaths; p++)
+        {
+            x[p][0] = problem->x0;
+        }
 
         for (int i = 0; i < nSteps; i++) {
 
-            struct SDE_coeffs c = solver->estimator(x[i], t[i]);
-            x[i+1] = x[i];
+            mat xs(nPaths);
+            for (int p = 0; p < nPaths; p++)
+            {
+                xs[p] = x[p][i];
+            }
+
+            vector<SDE_coeffs> c = solver->estimator_batch(xs, t[i]);
 
-            for (int i1 = 0; i1 < problem->ns; i1++) {
-                for (int i2 = 0; i2 < problem->ns; i2++) {
-                    x[i+1][i1] += c.diff[i1][i2]*sqrt(Dt)*dWs[i][i2];
+            for (int p = 0; p < nPaths; p++) {
+                x[p][i+1] = x[p][i];
+                for (int i1 = 0; i1 < problem->ns; i1++) {
+                    for (int i2 = 0; i2 < problem->ns; i2++) {
+                        x[p][i+1][i1] += c[p].diff[i1][i2]*sqrt(Dt)*dWs[p][i][i2];
+                    }
+                    x[p][i+1][i1] += Dt*c[p].drif[i1];
                 }
-                x[i+1][i1] += Dt*c.drif[i1];
             }
         }
 
         time = t;
-        solution = x;
+        solutions = x;
     }
 }
 
 int main(int argc, char* argv[]) {
 
-    // Initialization of the problem and helper analyser
+    // Initialization of the problem and helper analyser. The statistics are
+    // updated along the paths, from one value of x to a nearby one.
     Problem problem; problem.init();
-    Analyser analyser(&problem);
+    config_analyser conf_analyser;
+    conf_analyser.warm_iterations = 2;
+    conf_analyser.restart_tolerance = 0.1;
+    Analyser analyser(&problem, &conf_analyser);
 
     // Degrees for spectral methmd
     int degree_min = 5;
@@ -74,32 +97,41 @@ int main(int argc, char* argv[]) {
     // Error measured as E sup[0,T] |x - xe|^2
     vec error_Esup2(degrees.size(), 0.);
 
-    for (unsigned int p = 0; p < nPaths; p++)
+    // Solvers, shared by all the paths so that quantities that do not depend
+    // on x, such as the factorization of the linear system, are computed once.
+    Solver_exact solver_exact(&problem, &analyser);
+
+    vector<config_spectral> confs_spectral(degrees.size());
+    vector<Solver_spectral> solvers_spectral;
+    for (unsigned int i = 0; i < degrees.size(); ++i)
     {
-        // Seed for Brownian motion
-        int seed = p*1e5;
+        confs_spectral[i].n_nodes = 100;
+        confs_spectral[i].degree = degrees[i];
+        confs_spectral[i].scaling = vec(problem.nf, problem.sigma);
+        solvers_spectral.push_back(Solver_spectral(&problem, &analyser, &confs_spectral[i]));
+    }
 
-        // Define variables
-        vec time;
-        mat sol_exact;
-        cube sol_spectral(degrees.size());
+    // Seeds for Brownian motions
+    vector<int> seeds(nPaths);
+    for (unsigned int p = 0; p < nPaths; p++)
+    {
+        seeds[p] = p*1e5;
+    }
 
-        // Integrate in time using exact and spectral solvers
-        Solver_exact solver_exact(&problem, &analyser);
-        tests::integrate(&problem, &solver_exact, seed, time, sol_exact);
+    // Integrate in time using exact and spectral solvers
+    vec time;
+    cube sol_exact;
+    vector<cube> sol_spectral(degrees.size());
 
-        for (unsigned int i = 0; i < degrees.size(); ++i)
-        {
-            config_spectral conf_spectral; {
-                conf_spectral.n_nodes = 100;
-                conf_spectral.degree = degrees[i];
-                conf_spectral.scaling = vec(problem.nf, problem.sigma);
-            }
+    tests::integrate(&problem, &solver_exact, seeds, time, sol_exact);
 
-            Solver_spectral solver_spectral = Solver_spectral(&problem, &analyser, &conf_spectral);
-            tests::integrate(&problem, &solver_spectral, seed, time, sol_spectral[i]);
-        }
+    for (unsigned int i = 0; i < degrees.size(); ++i)
+    {
+        tests::integrate(&problem, &solvers_spectral[i], seeds, time, sol_spectral[i]);
+    }
 
+    for (unsigned int p = 0; p < nPaths; p++)
+    {
         // Calculate errors
         cube error(degrees.size());
         mat error_abs(degrees.size(), vec(time.size()));
@@ -107,7 +139,7 @@ int main(int argc, char* argv[]) {
 
         for (unsigned int i = 0; i < degrees.size(); i++)
         {
-            error[i] = sol_spectral[i] - sol_exact;
+            error[i] = sol_spectral[i][p] - sol_exact[p];
             for (unsigned int j = 0; j < time.size(); j++)
             {
                 error_abs[i][j] = fabs(error[i][j]);
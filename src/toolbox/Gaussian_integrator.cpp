@@ -1,5 +1,7 @@
 #include "toolbox/Gaussian_integrator.hpp"
 #include "global/templates.hpp"
+#include "toolbox/linear_algebra.hpp"
+#include <algorithm>
 
 using namespace std;
 
@@ -143,33 +145,82 @@ void Gaussian_integrator::Smolyak(vector< vector<double> >& snodes, vector<doubl
         double weight_mod = pow(-1, q - sum_index) * bin (N - 1, q - sum_index);
 
         quad_prod(this_sizes, aux_nodes, aux_weights);
-        aux_weights = aux_weights * weight_mod;
+        aux_weights *= weight_mod;
 
-        nodes.insert(nodes.end(), aux_nodes.begin(), aux_nodes.end());
-        weights.insert(weights.end(), aux_weights.begin(), aux_weights.end());
+        snodes.insert(snodes.end(), aux_nodes.begin(), aux_nodes.end());
+        sweights.insert(sweights.end(), aux_weights.begin(), aux_weights.end());
     }
 }
 
-Gaussian_integrator::Gaussian_integrator(int nNodes, int nVars) {
-
-    vector<double> nodes_1d(nNodes);
-    vector<double> weights_1d(nNodes);
+Gaussian_integrator::Gaussian_integrator(int nNodes, int nVars, double prune) {
 
     this->nVars = nVars;
+    this->tensor = (nNodes != 0);
 
+    vector< vector<double> > node_list;
     if (nNodes == 0)
-        Smolyak(nodes, weights);
+        Smolyak(node_list, weights);
     else {
         vector<int> seq(nVars, nNodes);
-        quad_prod(seq, nodes, weights);
+        quad_prod(seq, node_list, weights);
+        get_gh_quadrature(nNodes, nodes_1d, weights_1d);
+    }
+
+    // Pruning of the tensor grid: the product of the weights is that of the
+    // Gaussian at the node, up to a smooth factor, so the nodes kept lie
+    // roughly in a ball, instead of a cube.
+    if (nNodes != 0 && prune > 0.) {
+        double threshold = prune * *max_element(weights.begin(), weights.end());
+        unsigned int n_kept = 0;
+        for (unsigned int i = 0; i < weights.size(); ++i) {
+            if (weights[i] >= threshold) {
+                node_list[n_kept] = node_list[i];
+                weights[n_kept++] = weights[i];
+            }
+        }
+        this->tensor = (n_kept == weights.size());
+        node_list.resize(n_kept);
+        weights.resize(n_kept);
     }
+
+    // Store the nodes contiguously
+    nodes = dense_mat(nVars, node_list.size());
+    for (unsigned int i = 0; i < node_list.size(); ++i)
+        for (int k = 0; k < nVars; ++k)
+            nodes(k,i) = node_list[i][k];
 }
 
-double Gaussian_integrator::quadnd(function<double(vector<double>)> f) {
-    double result = 0.;
-    for (unsigned int i = 0; i < nodes.size(); ++i) {
-        result += f(nodes[i]) * weights[i];
+map< tuple<int,int,double>, shared_ptr<const Gaussian_integrator> > Gaussian_integrator::cache;
+mutex Gaussian_integrator::cache_mutex;
+
+// The integrators are immutable once built, so they can be shared between
+// solvers and threads. Only the lookup is serialized.
+shared_ptr<const Gaussian_integrator> Gaussian_integrator::cached(int nNodes, int nVars, double prune) {
+
+    lock_guard<mutex> lock(cache_mutex);
+
+    shared_ptr<const Gaussian_integrator>& entry = cache[make_tuple(nNodes, nVars, prune)];
+    if (!entry)
+        entry = make_shared<const Gaussian_integrator>(nNodes, nVars, prune);
+
+    return entry;
+}
+
+dense_mat Gaussian_integrator::map_nodes(const vector< vector<double> >& A, const vector<double>& b) const {
+
+    size_t n = nodes.n_cols;
+    dense_mat result(n, b.size());
+
+    // Y = Z^T A^T, written directly to the result (to_arma(A) is A^T)
+    arma::mat Y(result.memptr(), n, b.size(), false, true);
+    Y = nodes.arma().t() * to_arma(A);
+
+    for (size_t k = 0; k < b.size(); ++k) {
+        double* y_k = result.colptr(k);
+        for (size_t i = 0; i < n; ++i)
+            y_k[i] += b[k];
     }
+
     return result;
 }
 
@@ -190,19 +241,19 @@ void Gaussian_integrator::test_integrator() {
         cout << endl;
 
         double integral_s = 0.;
-        for (unsigned int j = 0; j < smolyak.nodes.size(); ++j) {
+        for (unsigned int j = 0; j < smolyak.nodes.n_cols; ++j) {
             double eval_monomial = 1.;
             for (unsigned int k = 0; k < index.size(); ++k)
-                eval_monomial *= pow(smolyak.nodes[j][k], index[k]);
+                eval_monomial *= pow(smolyak.nodes(k,j), index[k]);
             integral_s += eval_monomial * smolyak.weights[j];
         }
         cout << "Integral Smolyak: " << integral_s << endl;
 
         double integral_g = 0.;
-        for (unsigned int j = 0; j < gauss64.nodes.size(); ++j) {
+        for (unsigned int j = 0; j < gauss64.nodes.n_cols; ++j) {
             double eval_monomial = 1.;
             for (unsigned int k = 0; k < index.size(); ++k)
-                eval_monomial *= pow(gauss64.nodes[j][k], index[k]);
+                eval_monomial *= pow(gauss64.nodes(k,j), index[k]);
             integral_g += eval_monomial * gauss64.weights[j];
         }
         cout << "Integral Gauss64: " << integral_g << endl;
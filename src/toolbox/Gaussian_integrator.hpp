@@ -3,10 +3,13 @@
 
 #define PI 3.141592653589793238462643383279502884
 
-#include <functional>
 #include <vector>
 #include <cmath>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
 #include "global/templates.hpp"
 #include "toolbox/combinatorics.hpp"
 
@@ -14,21 +17,34 @@ class Gaussian_integrator {
 
 
     public:
-        Gaussian_integrator(int nNodes, int nVars);
+        // Tensor product of Gauss-Hermite rules with nNodes per dimension, or
+        // Smolyak rule if nNodes is 0. If prune > 0, the nodes of the tensor
+        // grid whose weight is below prune times the largest weight are
+        // dropped; with 100 nodes, most weights are far below the precision.
+        Gaussian_integrator(int nNodes, int nVars, double prune = 0.);
 
-        double quadnd(std::function<double(std::vector<double>)> f);
+        // Shared integrator with the given number of nodes per dimension
+        // (0 for the Smolyak rule), number of dimensions and pruning.
+        // Integrators are built on first use and kept for the lifetime of the
+        // process.
+        static std::shared_ptr<const Gaussian_integrator> cached(int nNodes, int nVars, double prune = 0.);
 
-        template<typename T, typename F> std::vector<T> quadnd(F f, const std::vector<T>& v0) {
-            std::vector<T> result = v0;
-            for (unsigned int i = 0; i < nodes.size(); ++i) {
-                result = result + f(nodes[i]) * weights[i];
-            }
-            return result;
-        }
+        // Nodes mapped by y = A z + b, as a matrix with one row per node: each
+        // coordinate is contiguous, the layout expected by the batched
+        // functions of Problem.
+        dense_mat map_nodes(const std::vector< std::vector<double> >& A, const std::vector<double>& b) const;
 
-        std::vector< std::vector<double> > nodes;
+        // Nodes, one per column, and weights
+        dense_mat nodes;
         std::vector<double> weights;
 
+        // Whether the nodes form a full tensor grid, which a pruned grid is
+        // not, in which case node i has coordinates nodes_1d[(i / n^k) % n]
+        // in dimension k, with n = nodes_1d.size().
+        bool tensor;
+        std::vector<double> nodes_1d;
+        std::vector<double> weights_1d;
+
         static void test_integrator();
 
     private:
@@ -36,6 +52,10 @@ class Gaussian_integrator {
         // Number of dimensions
         int nVars;
 
+        // Cache of the integrators, keyed by (nNodes, nVars, prune), and its lock
+        static std::map< std::tuple<int,int,double>, std::shared_ptr<const Gaussian_integrator> > cache;
+        static std::mutex cache_mutex;
+
         // Product of quadrature rules
         void quad_prod(std::vector<int> sizes, std::vector< std::vector<double> >& nodes, std::vector<double>& weights);
 
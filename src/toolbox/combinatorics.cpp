@@ -16,56 +16,134 @@ int bin(int n, int k) {
 
 // Standard normal gaussian
 double gaussian(vector<double> y) {
+    return gaussian(y.data(), y.size());
+}
+
+double gaussian(const double* y, int n) {
+    switch (n) {
+        case 1: return gaussian<1>(y);
+        case 2: return gaussian<2>(y);
+        case 3: return gaussian<3>(y);
+        case 4: return gaussian<4>(y);
+    }
+
     double result = 1.;
-    for (unsigned int i = 0; i < y.size(); ++i) {
+    for (int i = 0; i < n; ++i) {
         result *= exp(-y[i]*y[i]/2)/(sqrt(2*PI));
     }
     return result;
 }
 
-// Enumeration of the n-dimensional multi-indices i such that |i| = d
-vector< vector<int> > equal_multi_indices(int n, int d) {
-
-    // Univariate case
-    if (n == 1)
-        return vector< vector<int> > (1, vector<int> (1, d));
-
-    // Case where |i| = 0
-    if (d == 0)
-        return vector< vector<int> > (1, vector<int> (n, 0));
+// The first component absorbs the degree: the others are incremented like an
+// odometer, the second being the fastest, as long as their sum is at most the
+// degree.
+bool next_multi_index(int n, int* m) {
 
-    // Initialization of result
-    vector< vector<int> > result(0);
-
-    // Iteration on the first variable
-    for (int i = 0; i <= d; ++i) {
-        vector< vector<int> > aux = equal_multi_indices(n-1, d-i);
-        for (unsigned int j = 0; j < aux.size(); ++j) {
-            aux[j].push_back(i);
-            result.push_back(aux[j]);
+    for (int k = 1; k < n; ++k) {
+        if (m[0] > 0) {
+            m[k]++;
+            m[0]--;
+            return true;
         }
+        m[0] += m[k];
+        m[k] = 0;
     }
 
-    return result;
+    // m was the last multi-index, and is now (d, 0, ..., 0)
+    return false;
+}
+
+// Enumeration of the n-dimensional multi-indices i such that |i| = d
+vector< vector<int> > equal_multi_indices(int n, int d) {
+    return interval_multi_indices(n, d, d);
 }
 
 // Enumeration of the n-dimensional multi-indices i such that a <= |i| <= b
 vector< vector<int> > interval_multi_indices(int n, int a, int b) {
 
-    if (b == a)
-        return equal_multi_indices(n, a);
-
-    // Auxiliary results
-    vector< vector<int> > r_lower = interval_multi_indices(n, a, b-1);
-    vector< vector<int> > r_equal = equal_multi_indices(n, b);
+    vector< vector<int> > result;
+    vector<int> m(n, 0);
 
-    // Concatenation of the vectors
-    r_lower.insert(r_lower.end(), r_equal.begin(), r_equal.end());
+    for (int d = a; d <= b; ++d) {
+        m[0] = d;
+        do result.push_back(m);
+        while (next_multi_index(n, m.data()));
+    }
 
-    return r_lower;
+    return result;
 }
 
 // Enumeration of the n-dimensional multi-indices i such that |i| <= d
 vector< vector<int> > lower_multi_indices(int n, int d) {
     return interval_multi_indices(n, 0, d);
 }
+
+Multi_indices::Multi_indices(int n, int degree) : n(n), degree(degree) {
+
+    // Numbers of multi-indices, by Pascal's rule
+    n_lower = vector<size_t> ((n + 1)*(degree + 2), 0);
+    for (int k = 0; k <= n; ++k)
+        for (int d = 0; d <= degree; ++d)
+            n_lower[k*(degree + 2) + d + 1] = (k == 0) ? 1 : count(k-1, d) + count(k, d-1);
+
+    size = count(n, degree);
+    indices = vector<int> (size*n, 0);
+    degrees = vector<int> (size, 0);
+
+    // Enumeration, degree by degree
+    vector<int> m(n, 0);
+    size_t i = 0;
+    for (int d = 0; d <= degree && n > 0; ++d) {
+        m[0] = d;
+        do {
+            copy(m.begin(), m.end(), indices.begin() + i*n);
+            degrees[i++] = d;
+        } while (next_multi_index(n, m.data()));
+    }
+
+    // Predecessors in each direction
+    predecessors = vector<int> (size*n, -1);
+    for (i = 0; i < size; ++i) {
+        copy(indices.begin() + i*n, indices.begin() + (i+1)*n, m.begin());
+        for (int k = 0; k < n; ++k) {
+            if (m[k] > 0) {
+                m[k]--;
+                predecessors[i*n + k] = rank(m.data());
+                m[k]++;
+            }
+        }
+    }
+}
+
+// Multi-indices of lower degree come first. Among those of degree d, the
+// ones with a smaller last component j come first: there are
+// count(n-1, d) - count(n-1, d-j) of them. The rest is ranked recursively.
+size_t Multi_indices::rank(const int* m) const {
+
+    int d = 0;
+    for (int k = 0; k < n; ++k)
+        d += m[k];
+
+    size_t result = count(n, d-1);
+    for (int k = n - 1; k > 0; --k) {
+        result += count(k, d) - count(k, d - m[k]);
+        d -= m[k];
+    }
+
+    return result;
+}
+
+size_t Multi_indices::rank_sum(size_t i, size_t j) const {
+
+    int d = degrees[i] + degrees[j];
+    const int *m1 = (*this)[i], *m2 = (*this)[j];
+
+    size_t result = count(n, d-1);
+    for (int k = n - 1; k > 0; --k) {
+        int m = m1[k] + m2[k];
+        result += count(k, d) - count(k, d - m);
+        d -= m;
+    }
+
+    return result;
+}
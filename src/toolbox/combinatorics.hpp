@@ -7,15 +7,72 @@
 
 #include "toolbox/linear_algebra.hpp"
 
-// Functions to list multi-indices
+// Functions to list multi-indices. The multi-indices are ordered by total
+// degree, and, for a given degree, in lexicographic order of the components
+// from the last to the second.
 std::vector< std::vector<int> > equal_multi_indices(int n, int d);
 std::vector< std::vector<int> > lower_multi_indices(int n, int d);
 std::vector< std::vector<int> > interval_multi_indices(int n, int a, int b);
 
+// Next n-dimensional multi-index of the same degree, in the above order.
+// Returns false if m is the last one.
+bool next_multi_index(int n, int* m);
+
+/*! Set of the n-dimensional multi-indices m such that |m| <= degree
+ *
+ * The multi-indices are stored contiguously, in the order of
+ * lower_multi_indices. The position of a multi-index in the set, its rank,
+ * is computed in O(n) operations with the combinatorial number system: the
+ * number of multi-indices of dimension k and degree at most d is bin(d+k, k).
+ */
+class Multi_indices {
+
+    public:
+
+        Multi_indices(int n = 0, int degree = 0);
+
+        int n, degree;
+        size_t size;
+
+        // Components of the multi-index of rank i
+        const int* operator[] (size_t i) const { return indices.data() + i*n; }
+
+        // Total degree of the multi-index of rank i
+        int degree_of(size_t i) const { return degrees[i]; }
+
+        // Rank of a multi-index of degree at most the degree of the set, and
+        // rank of the sum of the multi-indices of ranks i and j
+        size_t rank(const int* m) const;
+        size_t rank_sum(size_t i, size_t j) const;
+
+        // Rank of m - e_k, with m of rank i, or -1 if it is not in the set.
+        int predecessor(size_t i, int k) const { return predecessors[i*n + k]; }
+
+    private:
+
+        std::vector<int> indices;
+        std::vector<int> degrees;
+        std::vector<int> predecessors;
+
+        // Number of k-dimensional multi-indices of degree at most d, at
+        // position k*(degree + 2) + d + 1, so that d = -1 is allowed.
+        std::vector<size_t> n_lower;
+        size_t count(int k, int d) const { return n_lower[k*(degree + 2) + d + 1]; }
+};
+
 // Binomial coefficients
 int bin(int n, int k);
 
-// Standard gaussian
+// Standard gaussian, with a version for dimensions known at compile time,
+// to which the runtime version dispatches for n <= 4.
 double gaussian(std::vector<double> y);
+double gaussian(const double* y, int n);
+
+template<int N> double gaussian(const double* y) {
+    double norm2 = 0.;
+    for (int i = 0; i < N; ++i)
+        norm2 += y[i]*y[i];
+    return exp(-norm2/2) / pow(2*PI, N/2.);
+}
 
 #endif
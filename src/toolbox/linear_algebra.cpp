@@ -64,3 +64,60 @@ std::mat square_root(const std::mat A) {
 vector<double> solve(std::mat A, std::vec b) {
     return to_std_vec(arma::solve(to_arma(A), to_arma_vec(b)));
 }
+
+skyline skyline_alloc(const vector<int>& first) {
+    skyline A;
+    A.first = first;
+    A.offset = vector<size_t> (first.size() + 1, 0);
+    for (size_t i = 0; i < first.size(); ++i) {
+        A.offset[i+1] = A.offset[i] + i - first[i] + 1;
+    }
+    A.values = vector<double> (A.offset[first.size()], 0.);
+    return A;
+}
+
+bool skyline_cholesky(skyline& A) {
+    int n = A.first.size();
+    for (int i = 0; i < n; ++i) {
+        for (int j = A.first[i]; j <= i; ++j) {
+            double sum = A(i,j);
+            for (int k = std::max(A.first[i], A.first[j]); k < j; ++k) {
+                sum -= A(i,k) * A(j,k);
+            }
+            if (j < i) {
+                A(i,j) = sum / A(j,j);
+            }
+            else if (sum > 0) {
+                A(i,i) = sqrt(sum);
+            }
+            else {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+arma::mat skyline_solve(const skyline& L, arma::mat B) {
+    int n = B.n_rows;
+    for (unsigned int c = 0; c < B.n_cols; ++c) {
+
+        // Forward substitution, L y = b
+        for (int i = 0; i < n; ++i) {
+            double sum = B(i,c);
+            for (int k = L.first[i]; k < i; ++k) {
+                sum -= L(i,k) * B(k,c);
+            }
+            B(i,c) = sum / L(i,i);
+        }
+
+        // Backward substitution, L^T x = y
+        for (int i = n - 1; i >= 0; --i) {
+            B(i,c) /= L(i,i);
+            for (int k = L.first[i]; k < i; ++k) {
+                B(k,c) -= L(i,k) * B(i,c);
+            }
+        }
+    }
+    return B;
+}
@@ -23,6 +23,30 @@ std::vector<double> solve(std::mat, std::vec);
 // Integer power.
 double ipow(double x, int e);
 
+// Symmetric matrix in skyline (variable band) storage. Row i contains the
+// entries of the lower triangular part from column first[i] to the
+// diagonal, stored contiguously from values[offset[i]].
+struct skyline {
+    std::vector<int> first;
+    std::vector<size_t> offset;
+    std::vector<double> values;
+
+    double& operator() (int i, int j) { return values[offset[i] + j - first[i]]; }
+    double operator() (int i, int j) const { return values[offset[i] + j - first[i]]; }
+};
+
+// Allocate a skyline matrix from the first column of each row.
+skyline skyline_alloc(const std::vector<int>& first);
+
+// In-place Cholesky factorization L L^T, which doesn't create fill-in outside
+// the skyline. Returns false if the matrix is not positive definite.
+bool skyline_cholesky(skyline& A);
+
+// Solve L L^T X = B with the leading n x n block of a Cholesky factor, where n
+// is the number of rows of B. This block is the factor of the leading block of
+// the original matrix.
+arma::mat skyline_solve(const skyline& L, arma::mat B);
+
 arma::mat to_arma(const std::mat &A);
 std::mat to_std(const arma::mat &A);
 
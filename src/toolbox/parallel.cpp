@@ -0,0 +1,45 @@
+#include "toolbox/parallel.hpp"
+
+using namespace std;
+
+int default_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+int resolve_threads(int n_threads) {
+    return n_threads > 0 ? n_threads : default_threads();
+}
+
+void evaluate_batch(batch_function f, const double* x, const dense_mat& ys, int n_outputs, double* out, int n_threads) {
+
+    size_t n = ys.n_rows, dim = ys.n_cols;
+    n_threads = resolve_threads(n_threads);
+
+    if (n_threads == 1 || n <= block_size) {
+        f(x, ys.memptr(), n, out);
+        return;
+    }
+
+    #pragma omp parallel num_threads(n_threads)
+    {
+        vector<double> y_block(block_size * dim), out_block(block_size * n_outputs);
+
+        #pragma omp for schedule(static)
+        for (size_t b = 0; b < n_blocks(n); ++b) {
+
+            size_t first = b*block_size, size = min(n, first + block_size) - first;
+
+            for (size_t k = 0; k < dim; ++k)
+                copy(ys.colptr(k) + first, ys.colptr(k) + first + size, y_block.begin() + k*size);
+
+            f(x, y_block.data(), size, out_block.data());
+
+            for (int m = 0; m < n_outputs; ++m)
+                copy(out_block.begin() + m*size, out_block.begin() + (m+1)*size, out + m*n + first);
+        }
+    }
+}
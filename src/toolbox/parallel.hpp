@@ -0,0 +1,62 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <vector>
+#include <algorithm>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "global/global.hpp"
+
+// Batched function of Problem, evaluated at n points
+typedef void (*batch_function) (const double* x, const double* y, size_t n, double* out);
+
+// Number of threads to use when none is given (n_threads <= 0): that of
+// OpenMP, which can be set with OMP_NUM_THREADS, or 1 without OpenMP.
+int default_threads();
+int resolve_threads(int n_threads);
+
+/*! Blocks of nodes
+ *
+ * Loops over the nodes are split into blocks of fixed size, independent of
+ * the number of threads. Reductions first sum over each block, then add the
+ * partial sums in the order of the blocks, so that their results don't
+ * depend on the number of threads.
+ */
+const size_t block_size = 1024;
+
+inline size_t n_blocks(size_t n) {
+    return (n + block_size - 1) / block_size;
+}
+
+/*! Evaluate a batched function at the points given by the rows of ys
+ *
+ * The result has n_outputs columns, stored contiguously in out with one row
+ * per point. With several threads, each block of points is copied to a
+ * buffer with the layout expected by the batched functions.
+ */
+void evaluate_batch(batch_function f, const double* x, const dense_mat& ys, int n_outputs, double* out, int n_threads = 0);
+
+/*! Deterministic parallel reduction over n nodes
+ *
+ * f(first, last, partial) adds the contributions of the nodes from first to
+ * last excluded to the array partial, of size n_results and initially zero.
+ * The partial sums are then added to result.
+ */
+template<class F> void blocked_reduce(size_t n, int n_results, double* result, F f, int n_threads = 0) {
+
+    size_t nb = n_blocks(n);
+    std::vector<double> partials(nb * n_results, 0.);
+
+    #pragma omp parallel for schedule(static) num_threads(resolve_threads(n_threads))
+    for (size_t b = 0; b < nb; ++b)
+        f(b*block_size, std::min(n, (b+1)*block_size), &partials[b*n_results]);
+
+    for (size_t b = 0; b < nb; ++b)
+        for (int r = 0; r < n_results; ++r)
+            result[r] += partials[b*n_results + r];
+}
+
+#endif